@@ -348,3 +348,566 @@ GET /backend
 --- response_headers
 Set-Cookie: route=908c1a9fb15095f454c085282da20d92; HttpOnly
 
+=== TEST 15: lb_alg=p2c, the server of the route is down
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.3:80 down;
+        server 127.0.0.4:80 down;
+        sticky hash=index lb_alg=p2c;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=0
+--- response_headers
+Set-Cookie: route=1
+
+=== TEST 16: lb_alg=chash, the server of the route is down
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.3:80 down;
+        server 127.0.0.4:80 down;
+        sticky hash=index lb_alg=chash key=$remote_addr;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=0
+--- response_headers
+Set-Cookie: route=1
+
+=== TEST 17: hash=id
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server 127.0.0.4:80;
+        server 127.0.0.5:80;
+        sticky name=route hash=id;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- response_headers
+Set-Cookie: route=7d224834
+
+=== TEST 18: learn, the second request goes where the session was created
+--- http_config
+    upstream backend {
+        server 127.0.0.1:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:$TEST_NGINX_SERVER_PORT;
+        sticky learn create=$upstream_http_x_session lookup=$http_x_session zone=sessions:1m;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        add_header X-Session s1;
+        echo $server_addr;
+    }
+    location /both {
+        echo_location /backend;
+        echo_location /backend;
+    }
+--- request
+GET /both
+--- more_headers
+X-Session: s1
+--- response_body
+127.0.0.1
+127.0.0.1
+
+=== TEST 19: route=, no cookie is issued
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        sticky hash=index route=$http_x_route;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+        add_header X-Upstream $upstream_addr;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+X-Route: 2
+--- response_headers
+X-Upstream: 127.0.0.1:1984
+
+=== TEST 20: route_suffix=
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        sticky hash=index route=$cookie_jsessionid route_suffix=.;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+        add_header X-Upstream $upstream_addr;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: JSESSIONID=A1B2C3.2
+--- response_headers
+X-Upstream: 127.0.0.1:1984
+
+=== TEST 21: route_suffix=, a session id holding the separator
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        sticky hash=index route=$cookie_jsessionid route_suffix=.;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+        add_header X-Upstream $upstream_addr;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: JSESSIONID=abc.def.2
+--- response_headers
+X-Upstream: 127.0.0.1:1984
+
+=== TEST 22: sticky_status, the counters of a routed request
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        sticky hash=index stats;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+    location /sticky_status {
+        sticky_status;
+    }
+    location /both {
+        echo_location /backend;
+        echo_location /sticky_status;
+    }
+--- request
+GET /both
+--- more_headers
+Cookie: route=0
+--- response_body_like chop
+\{"upstreams":\{"backend":\{"route":1,"matched":1,"unmatched":0,"down":0,"busy":0,"cookie":0,"fallback_rr":0,.*"peers":\[\{"server":"127\.0\.0\.1:\d+","route":0,"matched":1,.*\},\{"server":"127\.0\.0\.2:80","route":0,"matched":0,
+
+=== TEST 23: lb_alg=ewma, the server of the route is down
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.3:80 down;
+        server 127.0.0.4:80 down;
+        sticky hash=index lb_alg=ewma;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=0
+--- response_headers
+Set-Cookie: route=1
+
+=== TEST 24: lb_alg=random, the server of the route is down
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.3:80 down;
+        server 127.0.0.4:80 down;
+        sticky hash=index lb_alg=random;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=0
+--- response_headers
+Set-Cookie: route=1
+
+=== TEST 25: encoding=base64url
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server 127.0.0.4:80;
+        server 127.0.0.5:80;
+        sticky name=route hash=md5 encoding=base64url;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- response_headers
+Set-Cookie: route=kIwan7FQlfRUwIUoLaINkg
+
+=== TEST 26: digest_len=8
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server 127.0.0.4:80;
+        server 127.0.0.5:80;
+        sticky name=route hash=md5 digest_len=8;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- response_headers
+Set-Cookie: route=908c1a9fb15095f4
+
+=== TEST 27: encoding=base64url digest_len=8
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server 127.0.0.4:80;
+        server 127.0.0.5:80;
+        sticky name=route hash=md5 encoding=base64url digest_len=8;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- response_headers
+Set-Cookie: route=kIwan7FQlfQ
+
+=== TEST 28: digest_len=3 is refused
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        sticky name=route hash=md5 digest_len=3;
+    }
+--- config
+    location /backend {
+        proxy_pass http://backend;
+    }
+--- must_die
+--- error_log
+invalid value for "digest_len=", at least 4 bytes
+
+=== TEST 29: backup, no primary server left
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server 127.0.0.3:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT backup;
+        sticky hash=index;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- response_headers
+Set-Cookie: route=2
+
+=== TEST 30: backup, the route leads to it and is kept
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server 127.0.0.3:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT backup;
+        sticky hash=index;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=2
+--- response_headers
+!Set-Cookie
+
+=== TEST 31: failover=hrw, the server of the route is down
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.3:80 down;
+        server 127.0.0.4:80 down;
+        sticky hash=index failover=hrw;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=0
+--- response_headers
+Set-Cookie: route=1
+
+=== TEST 32: max_load_factor with no_fallback is refused
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        sticky max_load_factor=1.5 no_fallback;
+    }
+--- config
+    location /backend {
+        proxy_pass http://backend;
+    }
+--- must_die
+--- error_log
+"max_load_factor=" can't be used with "no_fallback"
+
+=== TEST 33: sticky_queue, waiting in vain for a down server with no_fallback
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT down;
+        server 127.0.0.2:80;
+        sticky hash=index no_fallback stats;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        sticky_queue backend length=4 timeout=50ms;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+        error_page 502 = /sticky_status;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+    location /sticky_status {
+        sticky_status;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=0
+--- response_body_like chop
+"backend":\{"route":1,"matched":1,.*"busy":1,.*"queued":1,"queue_full":0,"queue_timeout":1,
+
+=== TEST 34: slow_start=, the server of the route is down
+--- http_config
+    upstream backend {
+        server 127.0.0.2:80 down;
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.3:80 down;
+        server 127.0.0.4:80 down;
+        sticky hash=index lb_alg=lc slow_start=30s;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=0
+--- response_headers
+Set-Cookie: route=1
+
+=== TEST 35: $sticky_* without route
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server 127.0.0.4:80;
+        server 127.0.0.5:80;
+        sticky hash=index;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+        add_header X-Sticky "$sticky_status/$sticky_peer_index/$sticky_route/$sticky_lb_alg";
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- response_headers
+X-Sticky: miss/0//rr
+
+=== TEST 36: $sticky_* with a route matching no server
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server 127.0.0.4:80;
+        server 127.0.0.5:80;
+        sticky hash=index;
+    }
+--- config
+    location /backend {
+	rewrite /backend /frontend break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+        add_header X-Sticky "$sticky_status/$sticky_peer_index/$sticky_route/$sticky_lb_alg";
+    }
+    location /frontend {
+        echo -n $echo_client_request_headers;
+    }
+--- request
+GET /backend
+--- more_headers
+Cookie: route=9
+--- response_headers
+X-Sticky: invalid/0/9/rr
+
+
+=== TEST 37: $sticky_* after an internal redirect
+--- http_config
+    upstream backend {
+        server localhost:$TEST_NGINX_SERVER_PORT;
+        server 127.0.0.2:80;
+        server 127.0.0.3:80;
+        server 127.0.0.4:80;
+        server 127.0.0.5:80;
+        sticky hash=index;
+    }
+--- config
+    location /backend {
+	rewrite /backend /missing break;
+        proxy_pass http://backend;
+	proxy_set_header Host $host;
+        proxy_intercept_errors on;
+        error_page 404 = /error;
+    }
+    location /error {
+        add_header X-Sticky "$sticky_status/$sticky_peer_index/$sticky_route/$sticky_lb_alg";
+        echo -n error;
+    }
+--- request
+GET /backend
+--- response_headers
+X-Sticky: miss/0//rr
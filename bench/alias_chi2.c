@@ -0,0 +1,195 @@
+/*
+ * lb_alg=random: whether the alias table draws each peer in proportion
+ * to its weight. The table is built as ngx_http_sticky_alias_init() does
+ * and drawn from as ngx_http_upstream_get_random_peer() does, random()
+ * standing for ngx_random(). For four sets of weights, the columns must
+ * give each peer exactly weight * number, and 10M draws must pass a
+ * chi-square test against the weights at p = 0.001; the exit status is 1
+ * otherwise.
+ *
+ *   cc -O2 -o alias_chi2 bench/alias_chi2.c -lm && ./alias_chi2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#define DRAWS 10000000
+
+typedef struct {
+  uint64_t       prob;
+  unsigned long  alias;
+} alias_t;
+
+static alias_t       *table;
+static uint64_t       total;
+
+
+static void
+alias_init(unsigned long *weight, unsigned long number)
+{
+  unsigned long *work, i, s, l, nsmall, nlarge;
+  uint64_t      *scaled;
+
+  table = malloc(sizeof(alias_t) * number);
+  scaled = malloc(sizeof(uint64_t) * number);
+  work = malloc(sizeof(unsigned long) * number);
+
+  if (table == NULL || scaled == NULL || work == NULL) {
+    exit(1);
+  }
+
+  total = 0;
+
+  for (i = 0; i < number; i++) {
+    total += weight[i];
+  }
+
+  nsmall = 0;
+  nlarge = 0;
+
+  for (i = 0; i < number; i++) {
+    scaled[i] = (uint64_t) weight[i] * number;
+
+    if (scaled[i] < total) {
+      work[nsmall++] = i;
+    } else {
+      work[number - ++nlarge] = i;
+    }
+  }
+
+  while (nsmall && nlarge) {
+    s = work[--nsmall];
+    l = work[number - nlarge--];
+
+    table[s].prob = scaled[s];
+    table[s].alias = l;
+
+    scaled[l] -= total - scaled[s];
+
+    if (scaled[l] < total) {
+      work[nsmall++] = l;
+    } else {
+      work[number - ++nlarge] = l;
+    }
+  }
+
+  while (nlarge) {
+    l = work[number - nlarge--];
+    table[l].prob = total;
+    table[l].alias = l;
+  }
+
+  while (nsmall) {
+    s = work[--nsmall];
+    table[s].prob = total;
+    table[s].alias = s;
+  }
+
+  free(scaled);
+  free(work);
+}
+
+
+static unsigned long
+draw(unsigned long number)
+{
+  unsigned long i;
+
+  i = random() % number;
+
+  if ((((uint64_t) random() * total) >> 31) >= table[i].prob) {
+    i = table[i].alias;
+  }
+
+  return i;
+}
+
+
+/* Wilson-Hilferty, z = 3.090 for p = 0.001 */
+static double
+critical(unsigned long df)
+{
+  double a = 2.0 / (9.0 * df);
+
+  return df * pow(1.0 - a + 3.090 * sqrt(a), 3);
+}
+
+
+static int
+check(const char *name, unsigned long *weight, unsigned long number)
+{
+  unsigned long  i, k, *count;
+  uint64_t      *share;
+  double         expected, chi2, crit;
+  int            exact = 1;
+
+  alias_init(weight, number);
+
+  /* each column is worth total, split between the peer and its alias */
+  share = calloc(number, sizeof(uint64_t));
+  count = calloc(number, sizeof(unsigned long));
+
+  if (share == NULL || count == NULL) {
+    exit(1);
+  }
+
+  for (i = 0; i < number; i++) {
+    share[i] += table[i].prob;
+    share[table[i].alias] += total - table[i].prob;
+  }
+
+  for (i = 0; i < number; i++) {
+    if (share[i] != (uint64_t) weight[i] * number) {
+      exact = 0;
+    }
+  }
+
+  for (k = 0; k < DRAWS; k++) {
+    count[draw(number)]++;
+  }
+
+  chi2 = 0;
+
+  for (i = 0; i < number; i++) {
+    expected = (double) DRAWS * weight[i] / total;
+    chi2 += (count[i] - expected) * (count[i] - expected) / expected;
+  }
+
+  crit = critical(number - 1);
+
+  printf("%-28s %4lu peers  table %-5s  chi2 %8.2f  critical %8.2f  %s\n", name, number,
+         exact ? "exact" : "WRONG", chi2, crit, exact && chi2 < crit ? "ok" : "FAILED");
+
+  free(share);
+  free(count);
+  free(table);
+
+  return exact && chi2 < crit;
+}
+
+
+int
+main(void)
+{
+  static unsigned long uneven[] = { 1, 5, 3, 1, 10, 2, 7 };
+  static unsigned long equal[] = { 1, 1, 1, 1, 1, 1, 1, 1 };
+  static unsigned long skewed[] = { 1, 100, 1, 1 };
+  static unsigned long many[64];
+  unsigned long        i;
+  int                  failed = 0;
+
+  for (i = 0; i < 64; i++) {
+    many[i] = 1 + i % 10;
+  }
+
+  srandom(1);
+
+  failed += !check("uneven weights", uneven, sizeof(uneven) / sizeof(uneven[0]));
+  failed += !check("equal weights", equal, sizeof(equal) / sizeof(equal[0]));
+  failed += !check("one heavy peer", skewed, sizeof(skewed) / sizeof(skewed[0]));
+  failed += !check("weights 1 to 10", many, 64);
+
+  return failed != 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * Cookie header parsing: nanoseconds to find the route cookie, last of
+ * 65 cookies in a 4.4 KB header, with ngx_http_sticky_misc_find_cookie()
+ * and with the ngx_http_parse_multi_header_lines() of nginx 1.20 it
+ * replaced. Before timing, it checks which of several duplicate route
+ * cookies is kept, and exits with 1 if the rule is broken.
+ *
+ * Both parsers are copied below over just enough of the nginx types,
+ * find_cookie() has to follow ngx_http_sticky_misc.c.
+ *
+ *   cc -O2 -o find_cookie bench/find_cookie.c && ./find_cookie
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ITERATIONS 2000000
+
+#define NGX_OK        0
+#define NGX_DECLINED -5
+
+typedef unsigned char u_char;
+typedef intptr_t      ngx_int_t;
+typedef uintptr_t     ngx_uint_t;
+
+typedef struct { size_t len; u_char *data; } ngx_str_t;
+typedef struct { ngx_str_t key; ngx_str_t value; } ngx_table_elt_t;
+typedef struct { void *elts; ngx_uint_t nelts; } ngx_array_t;
+
+#define ngx_strncasecmp(s1, s2, n) strncasecmp((const char *) (s1), (const char *) (s2), n)
+
+typedef ngx_int_t (*ngx_http_sticky_misc_match_pt)(void *data, ngx_str_t *value);
+
+
+/* nginx 1.20 src/http/ngx_http_parse.c */
+static ngx_int_t
+ngx_http_parse_multi_header_lines(ngx_array_t *headers, ngx_str_t *name, ngx_str_t *value)
+{
+  ngx_uint_t         i;
+  u_char            *start, *last, *end, ch;
+  ngx_table_elt_t  **h;
+
+  h = headers->elts;
+
+  for (i = 0; i < headers->nelts; i++) {
+
+    if (name->len > h[i]->value.len) {
+      continue;
+    }
+
+    start = h[i]->value.data;
+    end = h[i]->value.data + h[i]->value.len;
+
+    while (start < end) {
+
+      if (ngx_strncasecmp(start, name->data, name->len) != 0) {
+        goto skip;
+      }
+
+      for (start += name->len; start < end && *start == ' '; start++) {
+        /* void */
+      }
+
+      if (value == NULL) {
+        if (start == end || *start == ',') {
+          return i;
+        }
+
+        goto skip;
+      }
+
+      if (start == end || *start++ != '=') {
+        /* the invalid header value */
+        goto skip;
+      }
+
+      while (start < end && *start == ' ') {
+        start++;
+      }
+
+      last = start;
+
+      while (last < end && *last != ';') {
+        last++;
+      }
+
+      value->len = last - start;
+      value->data = start;
+
+      return i;
+
+    skip:
+
+      while (start < end) {
+        ch = *start++;
+        if (ch == ';' || ch == ',') {
+          break;
+        }
+      }
+
+      while (start < end && *start == ' ') {
+        start++;
+      }
+    }
+  }
+
+  return NGX_DECLINED;
+}
+
+
+/* ngx_http_sticky_misc.c */
+static ngx_int_t
+ngx_http_sticky_misc_find_cookie(ngx_array_t *headers, ngx_str_t *name, ngx_str_t *value,
+                                 ngx_http_sticky_misc_match_pt match, void *data)
+{
+  u_char           *p, *end, *semi;
+  ngx_str_t         found;
+  ngx_uint_t        i, n;
+  ngx_table_elt_t **h;
+
+  n = 0;
+  h = headers->elts;
+
+  for (i = 0; i < headers->nelts; i++) {
+    p = h[i]->value.data;
+    end = p + h[i]->value.len;
+
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+      }
+
+      semi = memchr(p, ';', end - p);
+
+      if (semi == NULL) {
+        semi = end;
+      }
+
+      if ((size_t) (semi - p) > name->len && p[name->len] == '='
+          && ngx_strncasecmp(p, name->data, name->len) == 0)
+      {
+        found.data = p + name->len + 1;
+        found.len = semi - found.data;
+
+        if (n++ == 0) {
+          *value = found;
+
+        } else {
+          /* a duplicate, check the first one only now */
+          if (n == 2 && (match == NULL || match(data, value) == NGX_OK)) {
+            return NGX_OK;
+          }
+
+          if (match && match(data, &found) == NGX_OK) {
+            *value = found;
+            return NGX_OK;
+          }
+        }
+      }
+
+      p = semi + 1;
+    }
+  }
+
+  return n ? NGX_OK : NGX_DECLINED;
+}
+
+
+/* a route leads to a peer when it's "b" */
+static ngx_int_t
+match_b(void *data, ngx_str_t *value)
+{
+  (*(int *) data)++;
+
+  return (value->len == 1 && value->data[0] == 'b') ? NGX_OK : NGX_DECLINED;
+}
+
+
+static int
+find(const char *header, ngx_http_sticky_misc_match_pt match, int *calls, const char *expect)
+{
+  ngx_table_elt_t   elt, *pelt = &elt;
+  ngx_array_t       headers = { &pelt, 1 };
+  ngx_str_t         name = { 5, (u_char *) "route" }, value;
+  ngx_int_t         rc;
+
+  elt.value.data = (u_char *) header;
+  elt.value.len = strlen(header);
+
+  *calls = 0;
+  rc = ngx_http_sticky_misc_find_cookie(&headers, &name, &value, match, calls);
+
+  if (expect == NULL) {
+    return rc == NGX_DECLINED;
+  }
+
+  return rc == NGX_OK && value.len == strlen(expect) && memcmp(value.data, expect, value.len) == 0;
+}
+
+
+static int
+check(void)
+{
+  int calls, failed = 0;
+
+#define CHECK(cond, what)  if (!(cond)) { printf("FAILED: %s\n", what); failed++; }
+
+  CHECK(find("a=1; route=x; c=3", match_b, &calls, "x") && calls == 0,
+        "a single route cookie is used without calling match()");
+  CHECK(find("route=a; route=b; route=c", match_b, &calls, "b"),
+        "the first duplicate leading to a peer wins");
+  CHECK(find("route=b; route=a", match_b, &calls, "b") && calls == 1,
+        "the first cookie wins when it leads to a peer");
+  CHECK(find("route=a; route=c", match_b, &calls, "a"),
+        "the first cookie is used when none leads to a peer");
+  CHECK(find("route=a; route=c", NULL, &calls, "a"),
+        "without match(), the first cookie is used");
+  CHECK(find("myroute=b; route_x=b; ROUTE=y", match_b, &calls, "y"),
+        "names are matched whole, case insensitively");
+  CHECK(find("a=1, route=x", match_b, &calls, NULL),
+        "commas don't separate cookies");
+  CHECK(find("route=", match_b, &calls, ""),
+        "an empty route is found");
+  CHECK(find("a=1;\troute=x", match_b, &calls, "x"),
+        "leading spaces and tabs are skipped");
+
+  return failed;
+}
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int
+main(void)
+{
+  static u_char      buf[8192];
+  ngx_table_elt_t    elt, *pelt = &elt;
+  ngx_array_t        headers = { &pelt, 1 };
+  ngx_str_t          name = { 5, (u_char *) "route" }, value;
+  volatile size_t    sink = 0;
+  size_t             len = 0;
+  double             t;
+  int                i;
+
+  if (check()) {
+    return 1;
+  }
+
+  printf("duplicate route cookies: ok\n");
+
+  for (i = 0; i < 64; i++) {
+    len += sprintf((char *) buf + len, "%s_tracking_cookie_%02d=%s; ", i % 3 ? "ga" : "utm", i,
+                   "a1b2c3d4e5f60718293a4b5c6d7e8f90a1b2c3d4e5f6");
+  }
+
+  len += sprintf((char *) buf + len, "route=0123456789abcdef0123456789abcdef");
+
+  elt.value.data = buf;
+  elt.value.len = len;
+
+  printf("Cookie header of %zu bytes, 65 cookies, the route last\n", len);
+
+  t = now();
+
+  for (i = 0; i < ITERATIONS; i++) {
+    ngx_http_parse_multi_header_lines(&headers, &name, &value);
+    sink += value.len;
+  }
+
+  printf("ngx_http_parse_multi_header_lines: %7.1f ns\n", (now() - t) / ITERATIONS * 1e9);
+
+  t = now();
+
+  for (i = 0; i < ITERATIONS; i++) {
+    ngx_http_sticky_misc_find_cookie(&headers, &name, &value, NULL, NULL);
+    sink += value.len;
+  }
+
+  printf("ngx_http_sticky_misc_find_cookie:  %7.1f ns\n", (now() - t) / ITERATIONS * 1e9);
+
+  return sink == 0;
+}
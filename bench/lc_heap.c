@@ -0,0 +1,246 @@
+/*
+ * lb_alg=lc: nanoseconds per pick of the rotating linear scan of
+ * ngx_http_upstream_get_least_conn_peer() and of the heap of
+ * ngx_http_sticky_get_lc_heap_peer() / ngx_http_sticky_lc_update(), for
+ * upstreams of 4 to 1024 peers. NGX_HTTP_STICKY_LC_HEAP_MIN is the first
+ * size where the heap wins.
+ *
+ * Each operation picks the least conn peer and gives it a connection,
+ * then, once each peer holds 4 connections on average, releases one at
+ * random, as ngx_http_free_sticky_peer() would. One peer in 16 is down
+ * so the heap search has to go below it. Locks and the tried bitmap are
+ * left out.
+ *
+ *   cc -O2 -o lc_heap bench/lc_heap.c && ./lc_heap
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define OPS 2000000
+
+typedef struct {
+  unsigned long  conns;
+  unsigned long  weight;
+  unsigned long  down;
+  unsigned long  heap; /* position in the heap */
+  unsigned long  seq;  /* when it was last picked */
+} peer_t;
+
+static peer_t         *peers;
+static unsigned long  *heap, *stack, number, lc_seq;
+
+
+static int
+lc_less(unsigned long a, unsigned long b)
+{
+  peer_t *pa = &peers[a], *pb = &peers[b];
+
+  if (pa->conns * pb->weight != pb->conns * pa->weight) {
+    return pa->conns * pb->weight < pb->conns * pa->weight;
+  }
+
+  return pa->seq < pb->seq;
+}
+
+
+static void
+lc_swap(unsigned long h1, unsigned long h2)
+{
+  unsigned long i = heap[h1];
+
+  heap[h1] = heap[h2];
+  heap[h2] = i;
+
+  peers[heap[h1]].heap = h1;
+  peers[heap[h2]].heap = h2;
+}
+
+
+static void
+lc_update(unsigned long i)
+{
+  unsigned long h, child;
+
+  for (h = peers[i].heap; h > 0 && lc_less(i, heap[(h - 1) / 2]); h = (h - 1) / 2) {
+    lc_swap(h, (h - 1) / 2);
+  }
+
+  for ( ;; ) {
+    child = 2 * h + 1;
+
+    if (child >= number) {
+      break;
+    }
+
+    if (child + 1 < number && lc_less(heap[child + 1], heap[child])) {
+      child++;
+    }
+
+    if (!lc_less(heap[child], i)) {
+      break;
+    }
+
+    lc_swap(h, child);
+    h = child;
+  }
+}
+
+
+static unsigned long
+pick_heap(void)
+{
+  unsigned long h, i, sp = 0;
+  long          best = -1;
+
+  stack[sp++] = 0;
+
+  while (sp) {
+    h = stack[--sp];
+    i = heap[h];
+
+    if (best >= 0 && !lc_less(i, best)) {
+      continue;
+    }
+
+    if (peers[i].down) {
+      if (2 * h + 1 < number) {
+        stack[sp++] = 2 * h + 1;
+      }
+
+      if (2 * h + 2 < number) {
+        stack[sp++] = 2 * h + 2;
+      }
+
+      continue;
+    }
+
+    best = i;
+  }
+
+  peers[best].conns++;
+  peers[best].seq = ++lc_seq;
+  lc_update(best);
+
+  return best;
+}
+
+
+static unsigned long
+pick_scan(void)
+{
+  unsigned long i, r, best_r = 0, start;
+  long          best = -1;
+
+  start = lc_seq++ % number;
+
+  for (i = 0; i < number; i++) {
+    if (peers[i].down) {
+      continue;
+    }
+
+    r = (i + number - start) % number;
+
+    if (best < 0
+        || peers[i].conns * peers[best].weight < peers[best].conns * peers[i].weight
+        || (peers[i].conns * peers[best].weight == peers[best].conns * peers[i].weight && r < best_r))
+    {
+      best = i;
+      best_r = r;
+    }
+  }
+
+  peers[best].conns++;
+
+  return best;
+}
+
+
+static double
+now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static double
+run(unsigned long (*pick)(void), int use_heap)
+{
+  unsigned long *busy, nbusy, i, j, k;
+  double         start;
+
+  busy = malloc(sizeof(unsigned long) * (number * 4 + 1));
+
+  for (i = 0; i < number; i++) {
+    peers[i].conns = 0;
+    peers[i].weight = 1 + i % 3;
+    peers[i].down = (i % 16 == 15);
+    peers[i].heap = i;
+    peers[i].seq = 0;
+    heap[i] = i;
+  }
+
+  lc_seq = 0;
+  nbusy = 0;
+  srand(1);
+
+  start = now();
+
+  for (k = 0; k < OPS; k++) {
+    busy[nbusy++] = pick();
+
+    if (nbusy > number * 4) {
+      j = rand() % nbusy;
+      i = busy[j];
+      busy[j] = busy[--nbusy];
+
+      peers[i].conns--;
+
+      if (use_heap) {
+        lc_update(i);
+      }
+    }
+  }
+
+  start = now() - start;
+
+  free(busy);
+
+  return start / OPS * 1e9;
+}
+
+
+int
+main(void)
+{
+  static unsigned long sizes[] = { 4, 8, 12, 16, 20, 24, 32, 48, 64, 128, 256, 1024 };
+  unsigned long        s;
+
+  printf("%6s %12s %12s\n", "peers", "scan ns/op", "heap ns/op");
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    number = sizes[s];
+
+    peers = calloc(number, sizeof(peer_t));
+    heap = calloc(number, sizeof(unsigned long));
+    stack = calloc(number, sizeof(unsigned long));
+
+    if (peers == NULL || heap == NULL || stack == NULL) {
+      return 1;
+    }
+
+    printf("%6lu %12.1f", number, run(pick_scan, 0));
+    printf(" %12.1f\n", run(pick_heap, 1));
+
+    free(peers);
+    free(heap);
+    free(stack);
+  }
+
+  return 0;
+}
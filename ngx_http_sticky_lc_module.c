@@ -12,13 +12,196 @@
 
 #define NGX_LB_ALG_RR 1
 #define NGX_LB_ALG_LC 2
+#define NGX_LB_ALG_P2C 3
+#define NGX_LB_ALG_CHASH 4
+#define NGX_LB_ALG_EWMA 5
+#define NGX_LB_ALG_RANDOM 6
+
+/* stickiness counters, for each upstream and each of its peers */
+#define NGX_HTTP_STICKY_STAT_ROUTE     0 /* the request carried a route */
+#define NGX_HTTP_STICKY_STAT_MATCHED   1 /* the route matched a peer */
+#define NGX_HTTP_STICKY_STAT_UNMATCHED 2 /* the route matched no peer */
+#define NGX_HTTP_STICKY_STAT_DOWN      3 /* the routed peer was down or failed */
+#define NGX_HTTP_STICKY_STAT_BUSY      4 /* no_fallback turned the request down */
+#define NGX_HTTP_STICKY_STAT_COOKIE    5 /* a Set-Cookie was issued */
+#define NGX_HTTP_STICKY_STAT_FALLBACK  6 /* a peer was picked by lb_alg, one counter per lb_alg */
+#define NGX_HTTP_STICKY_STAT_FAILOVER  (NGX_HTTP_STICKY_STAT_FALLBACK + NGX_LB_ALG_RANDOM) /* picked by failover=hrw */
+#define NGX_HTTP_STICKY_STAT_SPILL     (NGX_HTTP_STICKY_STAT_FAILOVER + 1) /* the routed peer was over max_load_factor= */
+#define NGX_HTTP_STICKY_STAT_QUEUED    (NGX_HTTP_STICKY_STAT_SPILL + 1) /* sticky_queue: a request waited for its peer */
+#define NGX_HTTP_STICKY_STAT_QUEUE_FULL (NGX_HTTP_STICKY_STAT_SPILL + 2) /* the queue of its peer was full */
+#define NGX_HTTP_STICKY_STAT_QUEUE_TIMEOUT (NGX_HTTP_STICKY_STAT_SPILL + 3) /* it waited in vain */
+#define NGX_HTTP_STICKY_STAT_QUEUE_WAIT (NGX_HTTP_STICKY_STAT_SPILL + 4) /* milliseconds waited, not a count */
+#define NGX_HTTP_STICKY_STAT_N         (NGX_HTTP_STICKY_STAT_QUEUE_WAIT + 1)
+
+/* the routing decision of a request, for $sticky_status */
+#define NGX_HTTP_STICKY_OUTCOME_MISS     0 /* no route, lb_alg picked */
+#define NGX_HTTP_STICKY_OUTCOME_HIT      1 /* the peer of the route was used */
+#define NGX_HTTP_STICKY_OUTCOME_INVALID  2 /* the route matched no peer, lb_alg picked */
+#define NGX_HTTP_STICKY_OUTCOME_FALLBACK 3 /* the peer of the route couldn't take it, another one was picked */
+#define NGX_HTTP_STICKY_OUTCOME_BUSY     4 /* no_fallback turned it down */
+
+/* $sticky_lb_alg after NGX_LB_ALG_*, the peer was picked by failover=hrw or max_load_factor= */
+#define NGX_HTTP_STICKY_LB_HRW (NGX_LB_ALG_RANDOM + 1)
+
+/* the $sticky_* variables */
+#define NGX_HTTP_STICKY_VAR_STATUS     0
+#define NGX_HTTP_STICKY_VAR_PEER_INDEX 1
+#define NGX_HTTP_STICKY_VAR_ROUTE      2
+#define NGX_HTTP_STICKY_VAR_LB_ALG     3
+
+/* the stats block of an upstream has room for this many more peers, rounded */
+#define NGX_HTTP_STICKY_STATS_ROOM(n)  ngx_align((n) + 1, 16)
+
+/* response time histograms, in milliseconds, the last bucket is +Inf */
+#define NGX_HTTP_STICKY_HIST_BUCKETS 12
+
+/* histograms are kept apart for the peers reached through their route and the others */
+#define NGX_HTTP_STICKY_HIST_STICKY   0
+#define NGX_HTTP_STICKY_HIST_FALLBACK 1
+
+#define NGX_HTTP_STICKY_STATUS_JSON       0
+#define NGX_HTTP_STICKY_STATUS_PROMETHEUS 1
+
+/* random draws lb_alg=p2c makes to find its two candidates before scanning */
+#define NGX_HTTP_STICKY_P2C_TRIES 8
+
+/* ring points per unit of weight, and points lb_alg=chash walks before round robin */
+#define NGX_HTTP_STICKY_CHASH_POINTS 160
+#define NGX_HTTP_STICKY_CHASH_TRIES 20
+
+/*
+ * from this number of peers, lb_alg=lc keeps the peers in a binary heap
+ * ordered by conns / weight instead of scanning them all on each pick
+ */
+#define NGX_HTTP_STICKY_LC_HEAP_MIN 24
+
+/*
+ * lb_alg=ewma: response times are averaged with a weight of 1/8 in
+ * 1/16 ms units, a failure counts as a response of at least a second,
+ * and the average of a peer nobody picked halves every 10 seconds
+ */
+#define NGX_HTTP_STICKY_EWMA_SHIFT   4
+#define NGX_HTTP_STICKY_EWMA_WEIGHT  3
+#define NGX_HTTP_STICKY_EWMA_PENALTY 1000
+#define NGX_HTTP_STICKY_EWMA_DECAY   10000
+
+/* draws of lb_alg=random before it scans the peers like least conn */
+#define NGX_HTTP_STICKY_RANDOM_TRIES 20
+
+/* how long a learned session is kept when it's not used, 10 minutes */
+#define NGX_HTTP_STICKY_LEARN_TIMEOUT 600
+
+/* how raw digests are written in the cookie */
+#define NGX_HTTP_STICKY_ENCODING_HEX       0
+#define NGX_HTTP_STICKY_ENCODING_BASE64URL 1
+
+/* length of n bytes in unpadded base64url */
+#define NGX_HTTP_STICKY_BASE64URL_LEN(n)   (((n) * 4 + 2) / 3)
+
+/* sticky_queue defaults: how many requests may wait for a peer, and how long */
+#define NGX_HTTP_STICKY_QUEUE_LENGTH  16
+#define NGX_HTTP_STICKY_QUEUE_TIMEOUT 50
+
+/* slow_start=: thousandths of its weight a peer gets back at once, the rest ramps up linearly */
+#define NGX_HTTP_STICKY_SLOW_START_FLOOR 100
+
+/* where a session goes when the peer of its route fails */
+#define NGX_HTTP_STICKY_FAILOVER_LB_ALG    0 /* lb_alg picks a peer */
+#define NGX_HTTP_STICKY_FAILOVER_HRW       1 /* the highest random weight for the route */
+
+/* room for the largest raw digest (sha1, 20 bytes), zero padded to 64 bits words */
+#define NGX_HTTP_STICKY_DIGEST_WORDS 3
 
 /* define a peer */
 typedef struct {
-    ngx_http_upstream_rr_peer_t *rr_peer;
-    ngx_str_t                    digest;
+    ngx_http_upstream_rr_peer_t   *rr_peer;
+    ngx_str_t                      name;   /* the server address, zone peers may be freed before the route */
+    uint32_t                       id;     /* crc32 of the name, checks a learned session still fits the peer */
+    ngx_str_t                      digest; /* only for text=raw, the route is the text itself */
+    uint64_t                       bin[NGX_HTTP_STICKY_DIGEST_WORDS]; /* raw md5/sha1/hmac digest */
+    ngx_http_sticky_misc_cookie_t  cookie; /* prebuilt Set-Cookie value routing to this peer */
+
+    ngx_msec_t                     ewma;       /* lb_alg=ewma: average response time, worker local */
+    ngx_msec_t                     ewma_stamp; /* when it was last updated */
+
+    time_t                         down_since; /* failover_reissue=: when it started failing, 0 if it serves */
+
+    time_t                         recovered; /* slow_start=: when it came back or was added, 0 at full weight, worker local */
+    ngx_uint_t                     out;       /* it was down or failed when last seen */
+
+#if (NGX_UPSTREAM_CHECK_MODULE)
+    ngx_uint_t                     check_index; /* the peer of ngx_http_upstream_check_module */
+#endif
+
+    ngx_queue_t                    waiting;  /* sticky_queue: requests waiting for a connection, worker local */
+    ngx_uint_t                     nwaiting;
+
+    ngx_uint_t                     heap;   /* position in the least conn heap */
+    ngx_uint_t                     seq;    /* when it was last picked by least conn, breaks ties */
 } ngx_http_sticky_peer_t;
 
+/* a column of the alias table, the peer itself is drawn if below prob */
+typedef struct {
+    uint64_t                     prob;  /* out of the total weight */
+    ngx_uint_t                   alias;
+} ngx_http_sticky_alias_t;
+
+/* a point of the consistent hash ring */
+typedef struct {
+    uint32_t                     hash;
+    ngx_uint_t                   peer;
+} ngx_http_sticky_chash_point_t;
+
+/*
+ * a learned session in the shared zone, it starts at the color of its
+ * rbtree node, whose key is the crc32 of the session
+ */
+typedef struct {
+    u_char                       color;
+    u_char                       dummy;
+    u_short                      len;
+    ngx_queue_t                  queue;   /* least recently used last */
+    time_t                       last;
+    uint32_t                     peer_id; /* peers may have moved at reload, see ngx_http_sticky_peer_t.id */
+    ngx_uint_t                   peer;
+    u_char                       data[1];
+} ngx_http_sticky_learn_node_t;
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_http_sticky_learn_shctx_t;
+
+/* sticky learn: sessions created by the backends are bound to the peer which created them */
+typedef struct {
+    ngx_http_sticky_learn_shctx_t *sh;
+    ngx_slab_pool_t              *shpool;
+    time_t                        timeout;
+    ngx_int_t                     create; /* variable holding the session of a response */
+    ngx_int_t                     lookup; /* variable holding the session of a request */
+} ngx_http_sticky_learn_t;
+
+typedef struct {
+    ngx_atomic_t                 bucket[NGX_HTTP_STICKY_HIST_BUCKETS]; /* not cumulative */
+    ngx_atomic_t                 sum;    /* milliseconds */
+    ngx_atomic_t                 failed; /* of the requests counted, the ones which failed */
+} ngx_http_sticky_histogram_t;
+
+typedef struct {
+    ngx_atomic_t                 counter[NGX_HTTP_STICKY_STAT_N];
+    ngx_atomic_t                 queue_depth; /* requests waiting now, a gauge */
+    ngx_http_sticky_histogram_t  latency[2]; /* sticky, fallback */
+} ngx_http_sticky_counters_t;
+
+/* the counters of an upstream, in its stats zone */
+typedef struct {
+    ngx_uint_t                   number;   /* peers counted, the upstream may have grown since */
+    ngx_uint_t                   capacity; /* peers the block has room for, a reload may change number */
+    ngx_http_sticky_counters_t   upstream;
+    ngx_http_sticky_counters_t   peer[1];
+} ngx_http_sticky_stats_t;
+
 /* the configuration structure */
 typedef struct {
     ngx_http_upstream_srv_conf_t  uscf;
@@ -37,11 +220,101 @@ typedef struct {
 
     ngx_uint_t                    no_fallback;
     ngx_http_sticky_peer_t       *peers;
+    ngx_uint_t                    number;     /* number of primary peers in peers[] */
+    ngx_uint_t                    backup_number; /* number of backup peers, after the primary ones */
+    size_t                        digest_len; /* raw digest length, 0 when routes are text */
+    size_t                        digest_max; /* digest_len=, digests are truncated to it, 0 if not */
+    ngx_uint_t                    encoding;   /* NGX_HTTP_STICKY_ENCODING_* */
+
+    /* open addressing index from digest to peer, slots hold (peer index + 1) */
+    ngx_uint_t                   *lookup;
+    ngx_uint_t                    lookup_mask;
 
     ngx_uint_t                    lb_alg; /* select a load-balancing algorithm for default case */
+
+    ngx_uint_t                    failover;         /* NGX_HTTP_STICKY_FAILOVER_* */
+    time_t                        failover_reissue; /* failover=hrw keeps the cookie until the peer fails this long */
+
+    /* bounded loads: a routed peer above this many hundredths of the average load spills over, 0 if not */
+    ngx_uint_t                    max_load_factor;
+
+    time_t                        slow_start; /* a peer back from a failure or added ramps up to its weight in that time */
+
+    /*
+     * least conn heap: peer indexes ordered by conns / weight, then by seq.
+     * it only exists for large upstreams out of a shared zone, so it's
+     * private to each worker and needs no locking
+     */
+    ngx_uint_t                   *lc_heap;
+    ngx_uint_t                   *lc_stack; /* scratch stack to search the heap */
+    ngx_uint_t                    lc_seq;
+
+    /* lb_alg=chash: the key and the ring, sorted by hash */
+    ngx_http_complex_value_t     *chash_key;
+    ngx_http_sticky_chash_point_t *chash_points;
+    ngx_uint_t                    chash_number;
+
+    /* lb_alg=random: alias table over the weights of the primary peers */
+    ngx_http_sticky_alias_t      *alias;
+    uint64_t                      alias_total;
+
+    ngx_http_sticky_learn_t      *learn; /* NULL unless sticky learn */
+
+    /* route=: where the route comes from instead of the cookie, the backends set it */
+    ngx_http_complex_value_t     *route;
+    ngx_str_t                     route_suffix; /* the route follows this separator, jvmRoute style */
+
+    ngx_uint_t                    waiting; /* sticky_queue: requests waiting for one of the peers, worker local */
+
+    /* stats: counters in a zone of their own, shared by the workers */
+    ngx_uint_t                    stats_enabled;
+    ngx_shm_zone_t               *stats_zone;
+    ngx_http_sticky_stats_t      *stats;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    /* routes of a shared zone, rebuilt by each worker when the zone peers change */
+    ngx_pool_t                   *zone_pool;
+    ngx_http_upstream_rr_peer_t  *zone_peer;   /* first peer the routes were built against */
+    uint64_t                      zone_config; /* zone config version they were built against */
+    ngx_uint_t                    zone_generation; /* bumped by each rebuild of the routes */
+#endif
 } ngx_http_sticky_srv_conf_t;
 
 
+/* the location configuration, for sticky_status and sticky_queue */
+typedef struct {
+    ngx_uint_t                    status_format;
+
+    ngx_http_upstream_srv_conf_t *queue_upstream; /* NULL unless sticky_queue */
+    ngx_uint_t                    queue_length;
+    ngx_msec_t                    queue_timeout;
+} ngx_http_sticky_loc_conf_t;
+
+
+/* the module context, it lives as long as the request */
+typedef struct {
+    ngx_table_elt_t                   *set_cookie; /* the Set-Cookie header emitted by this module */
+
+    ngx_http_request_t                *request;
+
+    /* sticky_queue: the request waits for a connection to its peer to be released */
+    ngx_queue_t                        queue;       /* in the waiting list of the peer */
+    ngx_http_sticky_srv_conf_t        *queue_conf;
+    ngx_int_t                          queue_peer;
+    ngx_msec_t                         queue_start;
+    unsigned                           waiting:1;   /* in the waiting list */
+    unsigned                           queued:1;    /* it waited */
+    unsigned                           queue_done:1; /* it went on, or gave up */
+    unsigned                           decided:1;   /* a sticky upstream chose a peer, or tried */
+
+    /* the last routing decision, for the $sticky_* variables */
+    ngx_uint_t                         outcome;     /* NGX_HTTP_STICKY_OUTCOME_* */
+    ngx_int_t                          peer;        /* index of the peer used, -1 if none */
+    ngx_str_t                          route;       /* the route the request carried */
+    ngx_uint_t                         lb_alg;      /* what picked the peer when it wasn't the route, 0 if it was */
+} ngx_http_sticky_ctx_t;
+
+
 /* the custom sticky struct used on each request */
 typedef struct {
     /* the round robin data must be first */
@@ -51,17 +324,57 @@ typedef struct {
     int                                no_fallback;
     ngx_http_sticky_srv_conf_t        *sticky_conf;
     ngx_http_request_t                *request;
+    ngx_http_sticky_ctx_t             *ctx;
 
     ngx_uint_t                         lb_alg;
+    ngx_int_t                          route_peer; /* the peer the route led to, -1 if none */
+    ngx_uint_t                         spill;      /* it was over max_load_factor=, its route is kept */
+    uintptr_t                         *gate;       /* slow_start= with lb_alg=rr: peers held back from this pick */
+    ngx_uint_t                         gate_number; /* primary peers it was sized for, a zone may grow */
+
+    ngx_msec_t                         start;  /* when the current peer was picked */
+    ngx_uint_t                         sticky; /* the current peer came from the route */
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                         generation; /* the routes the indexes above refer to */
+#endif
 } ngx_http_sticky_peer_data_t;
 
 
 static char *ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void *ngx_http_sticky_create_conf(ngx_conf_t *cf);
+static char *ngx_http_sticky_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void *ngx_http_sticky_create_loc_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_sticky_stats_add(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us, ngx_http_sticky_srv_conf_t *conf);
 static ngx_int_t ngx_http_init_sticky_peer(ngx_http_request_t *r,     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_get_sticky_peer(ngx_peer_connection_t *pc, void *data);
 /* INFO: may confused with function in src/http/modules/ngx_http_upstream_least_conn_module.c */
 static ngx_int_t ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data);
+static ngx_int_t ngx_http_sticky_init_route(ngx_pool_t *pool, ngx_http_sticky_srv_conf_t *conf, ngx_http_sticky_peer_t *sp, ngx_uint_t i);
+static ngx_int_t ngx_http_sticky_init_lookup(ngx_pool_t *pool, ngx_log_t *log, ngx_http_sticky_srv_conf_t *conf, ngx_uint_t number,
+    ngx_uint_t strict);
+static ngx_int_t ngx_http_sticky_lookup(ngx_http_sticky_srv_conf_t *conf, ngx_str_t *route);
+static void ngx_http_free_sticky_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
+static ngx_int_t ngx_http_sticky_lc_init(ngx_conf_t *cf, ngx_http_sticky_srv_conf_t *conf);
+static void ngx_http_sticky_lc_update(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t i);
+static ngx_int_t ngx_http_sticky_get_lc_heap_peer(ngx_peer_connection_t *pc, ngx_http_sticky_peer_data_t *iphp);
+static ngx_int_t ngx_http_upstream_get_p2c_peer(ngx_peer_connection_t *pc, void *data);
+static ngx_int_t ngx_http_sticky_chash_init(ngx_pool_t *pool, ngx_http_sticky_srv_conf_t *conf);
+static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data);
+static ngx_int_t ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data);
+static ngx_int_t ngx_http_sticky_alias_init(ngx_pool_t *pool, ngx_http_sticky_srv_conf_t *conf);
+static ngx_int_t ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data);
+static ngx_int_t ngx_http_upstream_get_hrw_peer(ngx_peer_connection_t *pc, void *data);
+static void ngx_http_sticky_ewma_update(ngx_http_sticky_peer_data_t *iphp, ngx_uint_t k, ngx_uint_t failed);
+static ngx_int_t ngx_http_sticky_learn_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static ngx_int_t ngx_http_sticky_learn_lookup(ngx_http_request_t *r, ngx_http_sticky_srv_conf_t *conf);
+static void ngx_http_sticky_learn_store(ngx_http_request_t *r, ngx_http_sticky_srv_conf_t *conf, ngx_uint_t peer);
+static char *ngx_http_sticky_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_sticky_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
+static ngx_int_t ngx_http_sticky_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_sticky_add_variables(ngx_conf_t *cf);
+static void ngx_http_sticky_queue_leave(ngx_http_sticky_ctx_t *ctx);
+static void ngx_http_sticky_queue_wake(ngx_http_sticky_ctx_t *ctx);
 
 static ngx_command_t  ngx_http_sticky_commands[] = {
     {
@@ -72,13 +385,29 @@ static ngx_command_t  ngx_http_sticky_commands[] = {
         0,
         NULL
     },
+    {
+        ngx_string("sticky_status"),
+        NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS | NGX_CONF_TAKE1,
+        ngx_http_sticky_status,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("sticky_queue"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_TAKE123,
+        ngx_http_sticky_queue,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
     ngx_null_command
 };
 
 
 static ngx_http_module_t  ngx_http_sticky_lc_module_ctx = {
-    NULL,                                  /* preconfiguration */
-    NULL,                                  /* postconfiguration */
+    ngx_http_sticky_add_variables,         /* preconfiguration */
+    ngx_http_sticky_init,                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
     NULL,                                  /* init main configuration */
@@ -86,8 +415,8 @@ static ngx_http_module_t  ngx_http_sticky_lc_module_ctx = {
     ngx_http_sticky_create_conf,           /* create server configuration */
     NULL,                                  /* merge server configuration */
 
-    NULL,                                  /* create location configuration */
-    NULL                                   /* merge location configuration */
+    ngx_http_sticky_create_loc_conf,       /* create location configuration */
+    ngx_http_sticky_merge_loc_conf         /* merge location configuration */
 };
 
 
@@ -114,9 +443,9 @@ ngx_module_t  ngx_http_sticky_lc_module = {
 ngx_int_t
 ngx_http_init_upstream_sticky(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_http_upstream_rr_peers_t *rr_peers;
+    ngx_http_upstream_rr_peers_t *rr_peers, *backup;
     ngx_http_sticky_srv_conf_t *conf;
-    ngx_uint_t i;
+    ngx_uint_t i, n;
 
     /* call the rr module on wich the sticky module is based on */
     if( NGX_OK != ngx_http_upstream_init_round_robin(cf, us) ) {
@@ -136,504 +465,3739 @@ ngx_http_init_upstream_sticky(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
 
     conf = ngx_http_conf_upstream_srv_conf( us, ngx_http_sticky_lc_module );
 
-    /* if 'index', no need to alloc and generate digest */
-    if( !conf->hash && !conf->hmac && !conf->text ) {
-        conf->peers = NULL;
-        return NGX_OK;
-    }
+    /* create our own upstream indexes, the backup servers follow the primary ones */
+    backup = rr_peers->next;
+    n = rr_peers->number + (backup ? backup->number : 0);
 
-    /* create our own upstream indexes */
-    conf->peers = ngx_pcalloc( cf->pool, sizeof(ngx_http_sticky_peer_t) * rr_peers->number );
+    conf->peers = ngx_pcalloc( cf->pool, sizeof(ngx_http_sticky_peer_t) * n );
 
     if( NULL == conf->peers ) {
         return NGX_ERROR;
     }
 
+    conf->number = rr_peers->number;
+    conf->backup_number = n - rr_peers->number;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    /* in a zone the peers are copied to shared memory later, the first request resyncs */
+    conf->zone_pool = NULL;
+    conf->zone_peer = rr_peers->peer;
+    conf->zone_config = 0;
+#endif
+
     /* parse each peer and generate digest if necessary */
-    for(i = 0; i < rr_peers->number; i++) {
-        conf->peers[i].rr_peer = &rr_peers->peer[i];
+    for(i = 0; i < n; i++) {
+        conf->peers[i].rr_peer = i < conf->number ? &rr_peers->peer[i] : &backup->peer[i - conf->number];
+
+        if( NGX_OK != ngx_http_sticky_init_route(cf->pool, conf, &conf->peers[i], i) ) {
+            return NGX_ERROR;
+        }
+    }
 
-        if(conf->hmac) {
-            /* generate hmac */
-            conf->hmac(cf->pool, rr_peers->peer[i].sockaddr, rr_peers->peer[i].socklen, &conf->hmac_key,
-                       &conf->peers[i].digest);
+    /* counters are shared by the workers, each upstream has its zone */
+    if( conf->stats_enabled ) {
+        if( NGX_OK != ngx_http_sticky_stats_add(cf, us, conf) ) {
+            return NGX_ERROR;
+        }
+    }
 
-        } else if(conf->text) {
-            /* generate text */
-            conf->text(cf->pool, rr_peers->peer[i].sockaddr, &conf->peers[i].digest);
+    /* large upstreams pick their least conn peer out of a heap, which knows no slow_start= */
+    if( NGX_LB_ALG_LC == conf->lb_alg && conf->number >= NGX_HTTP_STICKY_LC_HEAP_MIN && NULL == us->shm_zone
+        && 0 == conf->slow_start )
+    {
+        if( NGX_OK != ngx_http_sticky_lc_init(cf, conf) ) {
+            return NGX_ERROR;
+        }
+    }
 
-        } else {
-            /* generate hash */
-            conf->hash(cf->pool, rr_peers->peer[i].sockaddr, rr_peers->peer[i].socklen, &conf->peers[i].digest);
+    /* cookieless clients are spread over a consistent hash ring */
+    if( NGX_LB_ALG_CHASH == conf->lb_alg ) {
+        if( NGX_OK != ngx_http_sticky_chash_init(cf->pool, conf) ) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* or drawn at random in proportion of their weights */
+    if( NGX_LB_ALG_RANDOM == conf->lb_alg ) {
+        if( NGX_OK != ngx_http_sticky_alias_init(cf->pool, conf) ) {
+            return NGX_ERROR;
         }
+    }
 
+    /* if 'index', the route is converted to an integer, no need to index digests */
+    if( !conf->hash && !conf->hmac && !conf->text ) {
+        return NGX_OK;
     }
 
-    return NGX_OK;
+    /* index the digests so a route is resolved without scanning all the peers */
+    return ngx_http_sticky_init_lookup(cf->pool, cf->log, conf, n, 1);
 }
 
 /*
- * function called by the upstream module when it inits each peer
- * it's called once per request
+ * compute the route of the peer at index i and prebuild its Set-Cookie value
  */
 static ngx_int_t
-ngx_http_init_sticky_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us)
+ngx_http_sticky_init_route(ngx_pool_t *pool, ngx_http_sticky_srv_conf_t *conf, ngx_http_sticky_peer_t *sp, ngx_uint_t i)
 {
-    ngx_http_sticky_peer_data_t  *iphp;
-    ngx_str_t                     route;
-    ngx_uint_t                    i;
-    ngx_int_t                     n;
+    ngx_http_upstream_rr_peer_t  *peer = sp->rr_peer;
+    ngx_str_t                     digest, route;
+    u_char                        buf[NGX_HTTP_STICKY_DIGEST_WORDS * 8 * 2];
 
-    /* alloc custom sticky struct */
-    iphp = ngx_palloc( r->pool, sizeof(ngx_http_sticky_peer_data_t) );
+    sp->name = peer->name;
+    sp->id = ngx_crc32_long(peer->name.data, peer->name.len);
+    ngx_queue_init(&sp->waiting);
 
-    if( NULL == iphp ) {
-        return NGX_ERROR;
-    }
+#if (NGX_UPSTREAM_CHECK_MODULE)
+    /* the round robin module registered it with the checker */
+    sp->check_index = peer->check_index;
+#endif
+    digest.len = 0;
 
-    /* attach it to the request upstream data */
-    r->upstream->peer.data = &iphp->rrp;
+    if(conf->hmac) {
+        /* generate hmac */
+        conf->hmac(pool, peer->sockaddr, peer->socklen, &conf->hmac_key, &digest);
 
-    /* call the rr module on which the sticky is based on */
-    if( NGX_OK != ngx_http_upstream_init_round_robin_peer(r, us) ) {
-        return NGX_ERROR;
+    } else if(conf->text == ngx_http_sticky_misc_text_raw) {
+        /* generate text, kept as is */
+        conf->text(pool, peer->sockaddr, &sp->digest);
+
+    } else if(conf->text) {
+        /* generate text digest */
+        conf->text(pool, peer->sockaddr, &digest);
+
+    } else if(conf->hash) {
+        /* generate hash */
+        conf->hash(pool, peer->sockaddr, peer->socklen, &digest);
     }
 
-    /* set the callback to select the next peer to use */
-    r->upstream->peer.get = ngx_http_get_sticky_peer;
+    if( conf->hash || conf->hmac || (conf->text && conf->text != ngx_http_sticky_misc_text_raw) ) {
 
-    /* init the custom sticky struct */
-    iphp->selected_peer = -1;
-    iphp->no_fallback = 0;
-    iphp->sticky_conf = ngx_http_conf_upstream_srv_conf( us, ngx_http_sticky_lc_module );
-    iphp->request = r;
+        if( 0 == digest.len || digest.len > sizeof(sp->bin) ) {
+            return NGX_ERROR;
+        }
 
-    /* check weather a cookie is present or not and save it */
-    if( NGX_DECLINED !=
-            ngx_http_parse_multi_header_lines( &r->headers_in.cookies, &iphp->sticky_conf->cookie_name, &route) ) {
+        /* shorter routes, collisions between peers are refused by the lookup table */
+        if( conf->digest_max && digest.len > conf->digest_max ) {
+            digest.len = conf->digest_max;
+        }
 
-        /* a route cookie has been found. Let's give it a try */
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                      "[sticky/init_sticky_peer] got cookie route=%V, let's try to find a matching peer", &route);
+        /* keep the raw digest, the cookie is decoded once and compared word by word */
+        ngx_memcpy(sp->bin, digest.data, digest.len);
+        conf->digest_len = digest.len;
 
-        /* hash, hmac or text, just compare digest */
-        if( iphp->sticky_conf->hash || iphp->sticky_conf->hmac || iphp->sticky_conf->text ) {
+        route.data = buf;
 
-            /* check internal struct has been set */
-            if( NULL == iphp->sticky_conf->peers ) {
-                /* log a warning, as it will continue without the sticky */
-                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                              "[sticky/init_sticky_peer] internal peers struct has not been set");
-                return NGX_OK; /* return OK, in order to continue */
-            }
+        if( NGX_HTTP_STICKY_ENCODING_BASE64URL == conf->encoding ) {
+            digest.data = (u_char *) sp->bin;
+            ngx_encode_base64url(&route, &digest);
 
-            /* search the digest found in the cookie in the peer digest list */
-            for(i = 0; i < iphp->rrp.peers->number; i++) {
+        } else {
+            /* raw digests go hex encoded in the cookie */
+            route.len = ngx_hex_dump(buf, (u_char *) sp->bin, conf->digest_len) - buf;
+        }
 
-                /* ensure the both len are equal and > 0 */
-                if( iphp->sticky_conf->peers[i].digest.len != route.len || route.len <= 0 ) {
-                    continue;
-                }
+    } else if( conf->text ) {
+        route = sp->digest;
 
-                if( 0 == ngx_strncmp(iphp->sticky_conf->peers[i].digest.data, route.data, route.len) ) {
-                    /* we found a match */
-                    iphp->selected_peer = i;
-                    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                                  "[sticky/init_sticky_peer] the route \"%V\" matches peer at index %ui", &route, i);
-                    return NGX_OK;
-                }
-            }
+    } else {
+        /* index, the route is the peer position */
+        route.data = buf;
+        route.len = ngx_sprintf(buf, "%ui", i) - buf;
+    }
 
-        } else {
+    /* build the whole Set-Cookie value once, requests only patch the Expires date */
+    return ngx_http_sticky_misc_init_cookie(pool, &sp->cookie, &conf->cookie_name, &route,
+                                            &conf->cookie_domain, &conf->cookie_path, conf->cookie_expires,
+                                            conf->cookie_secure, conf->cookie_httponly);
+}
 
-            /* switch back to index, convert cookie data to integer and ensure it corresponds to a valid peer */
-            n = ngx_atoi( route.data, route.len );
+/*
+ * hash a route for the lookup table
+ * raw digests are uniformly distributed, their first word is enough
+ */
+static ngx_inline ngx_uint_t
+ngx_http_sticky_lookup_key(ngx_http_sticky_srv_conf_t *conf, ngx_http_sticky_peer_t *peer)
+{
+    if( conf->digest_len ) {
+        /* fold, truncated digests may only fill the high half of the word */
+        return (ngx_uint_t) (peer->bin[0] ^ (peer->bin[0] >> 32));
+    }
 
-            if( NGX_ERROR == n ) {
-                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
-                              "[sticky/init_sticky_peer] unable to convert the route \"%V\" to an integer value", &route);
-            } else if( n >= 0 && n < (ngx_int_t)iphp->rrp.peers->number ) {
-                /* got one valid peer number */
-                ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                              "[sticky/init_sticky_peer] the route \"%V\" matches peer at index %i", &route, n);
-                iphp->selected_peer = n;
-                return NGX_OK;
+    return ngx_hash_key( peer->digest.data, peer->digest.len );
+}
+
+/*
+ * compare two routes, a mismatching digest fails on its first word
+ */
+static ngx_inline ngx_int_t
+ngx_http_sticky_route_eq(ngx_http_sticky_srv_conf_t *conf, ngx_http_sticky_peer_t *a, ngx_http_sticky_peer_t *b)
+{
+    ngx_uint_t  i;
+
+    if( conf->digest_len ) {
+        for( i = 0; i < NGX_HTTP_STICKY_DIGEST_WORDS; i++ ) {
+            if( a->bin[i] != b->bin[i] ) {
+                return 0;
             }
         }
 
-        /* found cookie, but no corresponding peer was found, continue with rr */
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                      "[sticky/init_sticky_peer] route \"%V\" doesn't match any peer. Ignoring it ...", &route);
-        return NGX_OK;
+        return 1;
     }
 
-    /* related cookies not found */
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                  "[sticky/init_sticky_peer] route cookie not found", &route);
-    return NGX_OK; /* return OK, in order to continue */
+    return a->digest.len == b->digest.len
+           && 0 == ngx_strncmp(a->digest.data, b->digest.data, a->digest.len);
 }
 
 /*
- * function called by the upstream module to choose the next peer to use
- * called at least one time per request
+ * build the digest -> peer index table
+ * it's sized to the next power of two above twice the number of peers,
+ * so linear probing stays short whatever the size of the upstream.
+ * Two servers with the same route are refused at configuration (strict),
+ * at runtime the last one is only left out of the table
  */
 static ngx_int_t
-ngx_http_get_sticky_peer(ngx_peer_connection_t *pc, void *data)
+ngx_http_sticky_init_lookup(ngx_pool_t *pool, ngx_log_t *log, ngx_http_sticky_srv_conf_t *conf, ngx_uint_t number,
+    ngx_uint_t strict)
 {
-    ngx_http_sticky_peer_data_t  *iphp = data;
-    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+    ngx_http_sticky_peer_t  *peer;
+    ngx_uint_t               i, size, slot;
 
-    ngx_int_t                     selected_peer = -1;
-    time_t                        now = ngx_time();
-    uintptr_t                     m = 0;
-    ngx_uint_t                    n = 0, i;
-    ngx_http_upstream_rr_peer_t  *peer = NULL;
+    for( size = 2; size < 2 * number; size <<= 1 ) { /* void */ }
 
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                  "[sticky/get_sticky_peer] get sticky peer, try: %ui, n_peers: %ui, no_fallback: %ui/%ui",
-                  pc->tries, iphp->rrp.peers->number, conf->no_fallback, iphp->no_fallback);
+    conf->lookup = ngx_pcalloc( pool, sizeof(ngx_uint_t) * size );
 
-    if( iphp->selected_peer >= 0  /* has got a selected peer */
-            && iphp->selected_peer < (ngx_int_t)iphp->rrp.peers->number /* legal peer number */
-            && !iphp->rrp.peers->single ) { /* has multiple peers */
+    if( NULL == conf->lookup ) {
+        return NGX_ERROR;
+    }
 
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                      "[sticky/get_sticky_peer] let's try the selected peer (%i)", iphp->selected_peer);
+    conf->lookup_mask = size - 1;
 
-        /* whether selected_peer has been tried */
-        n = iphp->selected_peer / (8 * sizeof(uintptr_t));
-        m = (uintptr_t) 1 << iphp->selected_peer % (8 * sizeof(uintptr_t)); /* get 0001 0010 0100 1000 from 0 1 2 3 */
+    for( i = 0; i < number; i++ ) {
 
-        if( 0 == (iphp->rrp.tried[n] & m) ) {
-            peer = &iphp->rrp.peers->peer[iphp->selected_peer];
+        if( 0 == conf->digest_len && 0 == conf->peers[i].digest.len ) {
+            continue;
+        }
 
-            if( peer->down ) {
-                iphp->no_fallback = conf->no_fallback;
-                ngx_log_error(NGX_LOG_NOTICE, pc->log, 0,
-                              "[sticky/get_sticky_peer] selected peer is down and no_fallback is flagged");
-                return NGX_BUSY;
-            }
+        slot = ngx_http_sticky_lookup_key( conf, &conf->peers[i] ) & conf->lookup_mask;
 
-            if( conf->no_fallback ) {
-                /* if enabled no_fallback ，server will return 504 when upstream is invalid */
-                iphp->no_fallback = 1;
+        while( conf->lookup[slot] ) {
 
-                /* reset fail_timeout after kicking out peer for enough time */
-                if( (now - peer->accessed) > peer->fail_timeout ) {
-                    peer->fails = 0;
-                }
+            peer = &conf->peers[conf->lookup[slot] - 1];
 
-                /* peer failed */
-                if( peer->max_fails > 0 && (peer->fails >= peer->max_fails) ) {
-                    ngx_log_error(NGX_LOG_NOTICE, pc->log, 0,
-                                  "[sticky/get_sticky_peer] selected peer is maked as failed ,no_fallback is flagged");
-                    return NGX_BUSY;
+            if( ngx_http_sticky_route_eq(conf, peer, &conf->peers[i]) ) {
+
+                /* two different servers share a route, one of them would never be reached */
+                if( peer->name.len != conf->peers[i].name.len
+                    || 0 != ngx_strncmp(peer->name.data, conf->peers[i].name.data, peer->name.len) )
+                {
+                    if( strict ) {
+                        ngx_log_error(NGX_LOG_EMERG, log, 0,
+                                      "[sticky/init_lookup] servers \"%V\" and \"%V\" have the same route",
+                                      &peer->name, &conf->peers[i].name);
+                        return NGX_ERROR;
+                    }
+
+                    /*
+                     * a server added to a zone: the others keep serving their routes, it only
+                     * gets lb_alg requests and no cookie, which would lead to the other one
+                     */
+                    ngx_log_error(NGX_LOG_ERR, log, 0,
+                                  "[sticky/init_lookup] servers \"%V\" and \"%V\" have the same route, "
+                                  "no route leads to the latter", &peer->name, &conf->peers[i].name);
+                    conf->peers[i].cookie.value.len = 0;
                 }
-            }
 
-            if( 0 == peer->max_fails || (peer->fails < peer->max_fails) ){
-                selected_peer = (ngx_int_t)n;
-            }
-            else if( (now - peer->accessed) > peer->fail_timeout) {
-                peer->fails = 0;
-                selected_peer = (ngx_int_t)n;
-            }
-            /* peer is max_fails or time is less than fail_timeout */
-            else {
-                /* mark as tried in bitmap */
-                iphp->rrp.tried[n] |= m;
+                /* keep the first one, as the linear scan did when the same server is declared twice */
+                break;
             }
+
+            slot = (slot + 1) & conf->lookup_mask;
         }
-    }
 
-    /* have a valid peer, tell the upstream module to use it */
-    if( peer && selected_peer >= 0 ) {
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                      "[sticky/get_sticky_peer] peer found at index %i", selected_peer);
+        if( 0 == conf->lookup[slot] ) {
+            conf->lookup[slot] = i + 1;
+        }
+    }
 
-#if defined(nginx_version) && nginx_version >= 1009000
-        iphp->rrp.current = peer;
-#else
-        iphp->rrp.current = iphp->selected_peer;
-#endif
-        /* save peer to peer connection ,done */
-        pc->cached = 0;
-        pc->connection = NULL;
-        pc->sockaddr = peer->sockaddr;
-        pc->socklen = peer->socklen;
-        pc->name = &peer->name;
+    return NGX_OK;
+}
 
-        /* mark as tried */
-        iphp->rrp.current->conns ++;
-        iphp->rrp.tried[n] |= m;
+/*
+ * resolve a route to a peer index, NGX_DECLINED if no peer matches
+ */
+static ngx_int_t
+ngx_http_sticky_lookup(ngx_http_sticky_srv_conf_t *conf, ngx_str_t *route)
+{
+    ngx_uint_t               slot;
+    ngx_http_sticky_peer_t   key, *peer;
+    ngx_str_t                decoded;
 
+    if( NULL == conf->lookup || 0 == route->len ) {
+        return NGX_DECLINED;
     }
-    /* peer is NULL or selected_peer == -1 means that no previous peer is valid */
-    else {
-        ngx_int_t ret = NGX_ERROR;
-
-        /* check fallback flag */
-        if( iphp->no_fallback ) {
-            ngx_log_error(NGX_LOG_NOTICE, pc->log, 0, "[sticky/get_sticky_peer] No fallback in action !");
-            return NGX_BUSY;
-        }
 
-        if( NGX_LB_ALG_RR == conf->lb_alg ) {
+    if( conf->digest_len ) {
 
-            iphp->lb_alg = NGX_LB_ALG_RR;
-            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_rr] LB_RR ");
+        ngx_memzero( key.bin, sizeof(key.bin) );
 
-            ret = ngx_http_upstream_get_round_robin_peer( pc, &iphp->rrp );
+        /* decode the cookie once, then compare raw digests */
+        if( NGX_HTTP_STICKY_ENCODING_BASE64URL == conf->encoding ) {
 
-        } else if( NGX_LB_ALG_LC == conf->lb_alg ) {
+            if( route->len != NGX_HTTP_STICKY_BASE64URL_LEN(conf->digest_len) ) {
+                return NGX_DECLINED;
+            }
 
-            iphp->lb_alg = NGX_LB_ALG_LC;
-            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_lc] LB_LC ");
+            decoded.data = (u_char *) key.bin;
 
-            ret = ngx_http_upstream_get_least_conn_peer( pc, &iphp->rrp );
+            if( NGX_OK != ngx_decode_base64url(&decoded, route) || decoded.len != conf->digest_len ) {
+                return NGX_DECLINED;
+            }
 
         } else {
-            return NGX_BUSY;
-        }
 
-        if( NGX_OK != ret ) {
-            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            if( route->len != 2 * conf->digest_len ) {
+                return NGX_DECLINED;
+            }
+
+            if( NGX_OK != ngx_http_sticky_misc_hex_decode((u_char *) key.bin, route->data, route->len) ) {
+                return NGX_DECLINED;
+            }
+        }
+
+    } else {
+        key.digest = *route;
+    }
+
+    slot = ngx_http_sticky_lookup_key( conf, &key ) & conf->lookup_mask;
+
+    while( conf->lookup[slot] ) {
+        peer = &conf->peers[conf->lookup[slot] - 1];
+
+        if( ngx_http_sticky_route_eq(conf, peer, &key) ) {
+            return conf->lookup[slot] - 1;
+        }
+
+        slot = (slot + 1) & conf->lookup_mask;
+    }
+
+    return NGX_DECLINED;
+}
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+/*
+ * the peers of a shared zone are copied to shared memory once the
+ * configuration is read, and may then change at runtime. Each worker
+ * rebuilds its routes when the zone peers differ from the ones they
+ * were built against; a server which kept its position and address
+ * keeps its route without being hashed again.
+ * called under the read locks of the peers and of their backup peers
+ */
+static ngx_int_t
+ngx_http_sticky_zone_sync(ngx_http_sticky_srv_conf_t *conf, ngx_http_upstream_rr_peers_t *peers, ngx_log_t *log)
+{
+    ngx_pool_t                     *pool;
+    ngx_http_sticky_peer_t         *table, *old, *sp;
+    ngx_http_upstream_rr_peers_t   *set;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_uint_t                      i, j, kept, number, backup_number, old_number, old_backup_number;
+    ngx_uint_t                      old_mask, old_chash_number;
+    ngx_int_t                       o;
+    ngx_uint_t                     *old_lookup;
+    ngx_http_sticky_chash_point_t  *old_chash;
+    ngx_http_sticky_alias_t        *old_alias;
+    uint64_t                        old_alias_total;
+    uint64_t                        config = 0;
+
+#if defined(nginx_version) && nginx_version >= 1027003
+    if( peers->config ) {
+        config = *peers->config;
+    }
+#endif
+
+    backup_number = peers->next ? peers->next->number : 0;
+
+    if( peers->peer == conf->zone_peer && peers->number == conf->number
+        && backup_number == conf->backup_number && config == conf->zone_config )
+    {
+        return NGX_OK;
+    }
+
+    pool = ngx_create_pool( NGX_DEFAULT_POOL_SIZE, log );
+
+    if( NULL == pool ) {
+        return NGX_ERROR;
+    }
+
+    table = ngx_pcalloc( pool, sizeof(ngx_http_sticky_peer_t) * (peers->number + backup_number ? peers->number + backup_number : 1) );
+
+    if( NULL == table ) {
+        ngx_destroy_pool( pool );
+        return NGX_ERROR;
+    }
+
+    old = conf->peers;
+    old_number = conf->number;
+    old_backup_number = conf->backup_number;
+    kept = 0;
+    number = 0;
+    i = 0;
+
+    /* the primary servers, then the backup ones */
+    for( set = peers; set; set = (set == peers) ? peers->next : NULL ) {
+        for( peer = set->peer, j = 0; peer && j < set->number; peer = peer->next, i++, j++ ) {
+            sp = &table[i];
+            sp->rr_peer = peer;
+
+            /* where the server at this position was in the old table */
+            if( set == peers ) {
+                number++;
+                o = j < old_number ? (ngx_int_t) j : -1;
+            } else {
+                o = j < old_backup_number ? (ngx_int_t) (old_number + j) : -1;
+            }
+
+            if( o >= 0
+                && ((ngx_uint_t) o == i || conf->hash || conf->hmac || conf->text) /* index, the route is the position */
+                && old[o].name.len == peer->name.len
+                && old[o].cookie.value.len /* a route left out for a conflict is built again */
+                && 0 == ngx_strncmp(old[o].name.data, peer->name.data, peer->name.len) )
+            {
+                /* same server at the same position, copy its route out of the old pool */
+                sp->name.data = ngx_pstrdup( pool, &peer->name );
+                sp->name.len = peer->name.len;
+                sp->id = old[o].id;
+                sp->ewma = old[o].ewma;
+                sp->ewma_stamp = old[o].ewma_stamp;
+                sp->down_since = old[o].down_since;
+#if (NGX_UPSTREAM_CHECK_MODULE)
+                sp->check_index = peer->check_index;
+#endif
+                sp->recovered = old[o].recovered;
+                sp->out = old[o].out;
+                ngx_queue_init( &sp->waiting );
+                sp->cookie = old[o].cookie;
+                sp->cookie.value.data = ngx_pstrdup( pool, &old[o].cookie.value );
+                ngx_memcpy( sp->bin, old[o].bin, sizeof(sp->bin) );
+
+                if( old[o].digest.len ) {
+                    sp->digest.data = ngx_pstrdup( pool, &old[o].digest );
+                    sp->digest.len = old[o].digest.len;
+                }
+
+                if( NULL == sp->name.data || NULL == sp->cookie.value.data
+                    || (old[o].digest.len && NULL == sp->digest.data) )
+                {
+                    ngx_destroy_pool( pool );
+                    return NGX_ERROR;
+                }
+
+                if( old[o].cookie.expires ) {
+                    sp->cookie.expires = sp->cookie.value.data + (old[o].cookie.expires - old[o].cookie.value.data);
+                }
+
+                kept++;
+                continue;
+            }
+
+            if( NGX_OK != ngx_http_sticky_init_route(pool, conf, sp, i) ) {
+                ngx_destroy_pool( pool );
+                return NGX_ERROR;
+            }
+
+            /* a new server ramps up like a recovered one */
+            sp->recovered = conf->slow_start ? ngx_time() : 0;
+
+            /* the name must outlive the zone peer */
+            sp->name.data = ngx_pstrdup( pool, &peer->name );
+
+            if( NULL == sp->name.data ) {
+                ngx_destroy_pool( pool );
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    old_lookup = conf->lookup;
+    old_mask = conf->lookup_mask;
+    old_chash = conf->chash_points;
+    old_chash_number = conf->chash_number;
+    old_alias = conf->alias;
+    old_alias_total = conf->alias_total;
+
+    /*
+     * requests waiting for the old peers look for their peer again,
+     * they leave the waiting lists of the old table
+     */
+    for( j = 0; j < old_number + old_backup_number; j++ ) {
+        while( !ngx_queue_empty(&old[j].waiting) ) {
+            ngx_http_sticky_queue_wake( ngx_queue_data(ngx_queue_head(&old[j].waiting), ngx_http_sticky_ctx_t, queue) );
+        }
+    }
+
+    conf->peers = table;
+    conf->number = number;
+    conf->backup_number = i - number;
+
+    if( (conf->hash || conf->hmac || conf->text)
+        && NGX_OK != ngx_http_sticky_init_lookup(pool, log, conf, i, 0) )
+    {
+        goto failed;
+    }
+
+    if( NGX_LB_ALG_CHASH == conf->lb_alg && NGX_OK != ngx_http_sticky_chash_init(pool, conf) ) {
+        goto failed;
+    }
+
+    /* weights may have changed too */
+    if( NGX_LB_ALG_RANDOM == conf->lb_alg && NGX_OK != ngx_http_sticky_alias_init(pool, conf) ) {
+        goto failed;
+    }
+
+    /* nothing points to the old routes anymore */
+    if( conf->zone_pool ) {
+        ngx_destroy_pool( conf->zone_pool );
+    }
+
+    conf->zone_pool = pool;
+    conf->zone_peer = peers->peer;
+    conf->zone_config = config;
+    conf->zone_generation++;
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "[sticky/zone_sync] routes of %ui peers rebuilt, %ui kept", i, kept);
+
+    return NGX_OK;
+
+failed:
+
+    conf->peers = old;
+    conf->number = old_number;
+    conf->backup_number = old_backup_number;
+    conf->lookup = old_lookup;
+    conf->lookup_mask = old_mask;
+    conf->chash_points = old_chash;
+    conf->chash_number = old_chash_number;
+    conf->alias = old_alias;
+    conf->alias_total = old_alias_total;
+
+    ngx_destroy_pool( pool );
+
+    return NGX_ERROR;
+}
+
+/*
+ * ngx_http_sticky_zone_sync() under the read locks, if the peers are in a zone
+ */
+static ngx_int_t
+ngx_http_sticky_zone_lock_sync(ngx_http_sticky_srv_conf_t *conf, ngx_http_upstream_rr_peers_t *peers, ngx_log_t *log)
+{
+    ngx_int_t  rc;
+
+    if( NULL == peers->shpool ) {
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    if( peers->next ) {
+        ngx_http_upstream_rr_peers_rlock(peers->next);
+    }
+
+    rc = ngx_http_sticky_zone_sync( conf, peers, log );
+
+    if( peers->next ) {
+        ngx_http_upstream_rr_peers_unlock(peers->next);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return rc;
+}
+
+#endif
+
+/*
+ * find the index of a peer in conf->peers, backup servers included,
+ * NGX_DECLINED if it's not one of them
+ */
+static ngx_int_t
+ngx_http_sticky_peer_index(ngx_http_sticky_srv_conf_t *conf, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_http_upstream_rr_peer_t  *first;
+    ngx_uint_t                    i;
+
+    if( NULL == conf->peers || 0 == conf->number || NULL == peer ) {
+        return NGX_DECLINED;
+    }
+
+    /* out of a zone, the primary peers are one array */
+    first = conf->peers[0].rr_peer;
+
+    if( peer >= first && peer < first + conf->number && conf->peers[peer - first].rr_peer == peer ) {
+        return peer - first;
+    }
+
+    for( i = 0; i < conf->number + conf->backup_number; i++ ) {
+        if( conf->peers[i].rr_peer == peer ) {
+            return i;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+/*
+ * count an event for the upstream and, if known, for the peer at index peer
+ */
+static ngx_inline void
+ngx_http_sticky_count(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t stat, ngx_int_t peer)
+{
+    ngx_http_sticky_stats_t  *stats = conf->stats;
+
+    if( NULL == stats ) {
+        return;
+    }
+
+    (void) ngx_atomic_fetch_add( &stats->upstream.counter[stat], 1 );
+
+    if( peer >= 0 && (ngx_uint_t) peer < stats->number ) {
+        (void) ngx_atomic_fetch_add( &stats->peer[peer].counter[stat], 1 );
+    }
+}
+
+/* upper bounds of the histogram buckets, in milliseconds */
+static ngx_msec_t  ngx_http_sticky_hist_bounds[NGX_HTTP_STICKY_HIST_BUCKETS - 1] = {
+    5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+/*
+ * account for how a request to a peer ended, lock free
+ */
+static void
+ngx_http_sticky_record(ngx_http_sticky_srv_conf_t *conf, ngx_int_t peer, ngx_uint_t sticky, ngx_msec_t ms,
+    ngx_uint_t failed)
+{
+    ngx_http_sticky_stats_t      *stats = conf->stats;
+    ngx_http_sticky_histogram_t  *h[2];
+    ngx_uint_t                    b, i, n;
+
+    for( b = 0; b < NGX_HTTP_STICKY_HIST_BUCKETS - 1; b++ ) {
+        if( ms <= ngx_http_sticky_hist_bounds[b] ) {
+            break;
+        }
+    }
+
+    n = 0;
+    h[n++] = &stats->upstream.latency[sticky ? NGX_HTTP_STICKY_HIST_STICKY : NGX_HTTP_STICKY_HIST_FALLBACK];
+
+    if( peer >= 0 && (ngx_uint_t) peer < stats->number ) {
+        h[n++] = &stats->peer[peer].latency[sticky ? NGX_HTTP_STICKY_HIST_STICKY : NGX_HTTP_STICKY_HIST_FALLBACK];
+    }
+
+    for( i = 0; i < n; i++ ) {
+        (void) ngx_atomic_fetch_add( &h[i]->bucket[b], 1 );
+        (void) ngx_atomic_fetch_add( &h[i]->sum, ms );
+
+        if( failed ) {
+            (void) ngx_atomic_fetch_add( &h[i]->failed, 1 );
+        }
+    }
+}
+
+/*
+ * can the peer at index i be picked by a load-balancing algorithm:
+ * neither tried, down, failed nor full
+ */
+static ngx_inline ngx_int_t
+ngx_http_sticky_peer_usable(ngx_http_upstream_rr_peer_data_t *rrp, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t i, time_t now)
+{
+    ngx_uint_t  n = i / (8 * sizeof(uintptr_t));
+    uintptr_t   m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if( (rrp->tried[n] & m) || peer->down ) {
+        return 0;
+    }
+
+    if( peer->max_fails && peer->fails >= peer->max_fails && now - peer->checked <= peer->fail_timeout ) {
+        return 0;
+    }
+
+#if defined(nginx_version) && nginx_version >= 1011005
+    if( peer->max_conns && peer->conns >= peer->max_conns ) {
+        return 0;
+    }
+#endif
+
+    return 1;
+}
+
+/*
+ * has the active health check found the peer at index k of conf->peers
+ * down, peers the checker doesn't know are up
+ */
+static ngx_inline ngx_int_t
+ngx_http_sticky_check_down(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t k)
+{
+#if (NGX_UPSTREAM_CHECK_MODULE)
+    if( k < conf->number + conf->backup_number ) {
+        return ngx_http_upstream_check_peer_down( conf->peers[k].check_index ) ? 1 : 0;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * hand the peer at index i to the upstream module and account for it
+ * in a shared zone, the caller holds the peer lock
+ */
+static ngx_inline void
+ngx_http_sticky_use_peer(ngx_peer_connection_t *pc, ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t i, time_t now)
+{
+    if( (now - peer->checked) > peer->fail_timeout ) {
+        peer->checked = now;
+    }
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen  = peer->socklen;
+    pc->name     = &peer->name;
+
+    peer->conns ++;
+
+    rrp->current = peer;
+    rrp->tried[i / (8 * sizeof(uintptr_t))] |= (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+}
+
+/*
+ * bounded loads: the conns and the weights of the primary peers which are up
+ * called under the peers read lock
+ */
+static void
+ngx_http_sticky_load(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t *conns, ngx_uint_t *weight)
+{
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_uint_t                    i;
+
+    *conns = 0;
+    *weight = 0;
+
+    for( i = 0; i < conf->number; i++ ) {
+        peer = conf->peers[i].rr_peer;
+
+        if( !peer->down ) {
+            *conns += peer->conns;
+            *weight += peer->weight;
+        }
+    }
+}
+
+/*
+ * is the load (conns / weight) of the peer at index i, given one more
+ * connection, above max_load_factor times the average load
+ */
+static ngx_inline ngx_int_t
+ngx_http_sticky_overloaded(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t i, ngx_uint_t conns, ngx_uint_t weight)
+{
+    ngx_http_upstream_rr_peer_t  *peer = conf->peers[i].rr_peer;
+
+    /* cross multiplied, factor is in hundredths */
+    return (uint64_t) (peer->conns + 1) * weight * 100
+           > (uint64_t) conf->max_load_factor * (conns + 1) * peer->weight;
+}
+
+/*
+ * slow_start=: thousandths of its weight the primary peer at index i has
+ * got back, 0 while it's down or failed. A peer seen coming back starts
+ * at the floor and ramps up linearly. Called under the peers read lock,
+ * the timestamps are worker local
+ */
+static ngx_uint_t
+ngx_http_sticky_slow_start_weight(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t i, time_t now)
+{
+    ngx_http_sticky_peer_t       *sp = &conf->peers[i];
+    ngx_http_upstream_rr_peer_t  *peer = sp->rr_peer;
+    time_t                        elapsed;
+
+    if( peer->down || (peer->max_fails && peer->fails >= peer->max_fails && now - peer->checked <= peer->fail_timeout) ) {
+        sp->out = 1;
+        return 0;
+    }
+
+    if( sp->out ) {
+        sp->out = 0;
+        sp->recovered = now;
+    }
+
+    if( 0 == sp->recovered ) {
+        return 1000;
+    }
+
+    elapsed = now - sp->recovered;
+
+    if( elapsed >= conf->slow_start ) {
+        sp->recovered = 0;
+        return 1000;
+    }
+
+    return NGX_HTTP_STICKY_SLOW_START_FLOOR
+           + (1000 - NGX_HTTP_STICKY_SLOW_START_FLOOR) * (ngx_uint_t) elapsed / (ngx_uint_t) conf->slow_start;
+}
+
+/*
+ * slow_start= with round robin, which knows nothing of it: a peer still
+ * ramping up is held back from this pick with the probability of the
+ * weight it hasn't got back, by marking it tried. The round robin module
+ * only sees peers at full weight held back if one of them can be picked
+ */
+static void
+ngx_http_sticky_slow_start_gate(ngx_http_sticky_peer_data_t *iphp, time_t now)
+{
+    ngx_http_sticky_srv_conf_t       *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peer_data_t *rrp = &iphp->rrp;
+    ngx_uint_t                        i, n, w, full = 0;
+    uintptr_t                         m;
+
+    n = (iphp->gate_number + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t));
+
+    ngx_memzero( iphp->gate, n * sizeof(uintptr_t) );
+
+    if( rrp->peers->peer != conf->peers[0].rr_peer || conf->number != iphp->gate_number ) {
+        return;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(rrp->peers);
+
+    for( i = 0; i < conf->number; i++ ) {
+        w = ngx_http_sticky_slow_start_weight( conf, i, now );
+        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+        if( 0 == w || (rrp->tried[i / (8 * sizeof(uintptr_t))] & m) ) {
+            continue;
+        }
+
+        if( 1000 == w ) {
+            full++;
+
+        } else if( (ngx_uint_t) ngx_random() % 1000 >= w ) {
+            iphp->gate[i / (8 * sizeof(uintptr_t))] |= m;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
+    for( i = 0; full && i < n; i++ ) {
+        rrp->tried[i] |= iphp->gate[i];
+    }
+
+    if( 0 == full ) {
+        ngx_memzero( iphp->gate, n * sizeof(uintptr_t) );
+    }
+}
+
+/*
+ * the route leads to a backup server: use it as long as no primary server
+ * can take the request, as the round robin module would switch to the
+ * backup servers. NGX_DECLINED when a primary server is usable, NGX_BUSY
+ * when the backup server isn't
+ */
+static ngx_int_t
+ngx_http_sticky_get_backup_peer(ngx_peer_connection_t *pc, ngx_http_sticky_peer_data_t *iphp)
+{
+    ngx_http_sticky_srv_conf_t       *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peer_data_t *rrp = &iphp->rrp;
+    ngx_http_upstream_rr_peers_t     *peers = rrp->peers;
+    ngx_http_upstream_rr_peers_t     *backup = peers->next;
+    ngx_http_upstream_rr_peer_t      *peer;
+    time_t                            now = ngx_time();
+    ngx_uint_t                        i, j, n;
+
+    if( NULL == backup ) {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for( i = 0; i < conf->number; i++ ) {
+        if( ngx_http_sticky_peer_usable(rrp, conf->peers[i].rr_peer, i, now) && !ngx_http_sticky_check_down(conf, i) ) {
+            break;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if( i < conf->number ) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                      "[sticky/get_backup_peer] primary peer %ui is usable, leaving the backup peers", i);
+        return NGX_DECLINED;
+    }
+
+    /* switch to the backup servers, their tried bits start over */
+    rrp->peers = backup;
+
+    n = (backup->number + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t));
+
+    for( i = 0; i < n; i++ ) {
+        rrp->tried[i] = 0;
+    }
+
+    j = iphp->selected_peer - conf->number;
+    peer = conf->peers[iphp->selected_peer].rr_peer;
+
+    ngx_http_upstream_rr_peers_rlock(backup);
+    ngx_http_upstream_rr_peer_lock(backup, peer);
+
+    if( !ngx_http_sticky_peer_usable(rrp, peer, j, now) || ngx_http_sticky_check_down(conf, iphp->selected_peer) ) {
+        ngx_http_upstream_rr_peer_unlock(backup, peer);
+        ngx_http_upstream_rr_peers_unlock(backup);
+        return NGX_BUSY;
+    }
+
+    ngx_http_sticky_use_peer(pc, rrp, peer, j, now);
+
+    ngx_http_upstream_rr_peer_unlock(backup, peer);
+    ngx_http_upstream_rr_peers_unlock(backup);
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                  "[sticky/get_backup_peer] no primary peer usable, backup peer %ui found", j);
+
+    return NGX_OK;
+}
+
+/*
+ * does a route cookie lead to one of our peers, used to pick between
+ * duplicate route cookies
+ */
+static ngx_int_t
+ngx_http_sticky_route_match(void *data, ngx_str_t *route)
+{
+    ngx_http_sticky_srv_conf_t  *conf = data;
+    ngx_int_t                    n;
+
+    if( conf->hash || conf->hmac || conf->text ) {
+        n = ngx_http_sticky_lookup( conf, route );
+    } else {
+        n = ngx_atoi( route->data, route->len );
+    }
+
+    return ( n >= 0 && n < (ngx_int_t) (conf->number + conf->backup_number) ) ? NGX_OK : NGX_DECLINED;
+}
+
+/*
+ * read the route of a request: the cookie, or the route= value, which
+ * is cut after the last route_suffix= when set ("<session>.<route>")
+ */
+static ngx_int_t
+ngx_http_sticky_get_route(ngx_http_request_t *r, ngx_http_sticky_srv_conf_t *conf, ngx_str_t *route)
+{
+    u_char  *p;
+
+    if( NULL == conf->route ) {
+        return ngx_http_sticky_misc_find_cookie( &r->headers_in.cookies, &conf->cookie_name, route,
+                                                 ngx_http_sticky_route_match, conf );
+    }
+
+    if( NGX_OK != ngx_http_complex_value(r, conf->route, route) ) {
+        return NGX_ERROR;
+    }
+
+    if( conf->route_suffix.len ) {
+        if( route->len < conf->route_suffix.len ) {
+            return NGX_DECLINED;
+        }
+
+        /* the session id may hold the separator too, the route follows the last one */
+        p = route->data + route->len - conf->route_suffix.len;
+
+        while( 0 != ngx_strncmp( p, conf->route_suffix.data, conf->route_suffix.len ) ) {
+            if( p == route->data ) {
+                return NGX_DECLINED;
+            }
+
+            p--;
+        }
+
+        p += conf->route_suffix.len;
+
+        route->len -= p - route->data;
+        route->data = p;
+    }
+
+    return route->len ? NGX_OK : NGX_DECLINED;
+}
+
+/*
+ * the request is finalized, while waiting in sticky_queue for instance
+ * (client gone); the cleanup also lets the context be found again
+ */
+static void
+ngx_http_sticky_ctx_cleanup(void *data)
+{
+    ngx_http_sticky_ctx_t  *ctx = data;
+
+    if( ctx->waiting ) {
+        ngx_http_sticky_queue_leave( ctx );
+    }
+}
+
+/*
+ * the request context: an internal redirect (error_page, try_files...)
+ * clears r->ctx, it's found again through its pool cleanup, as the realip
+ * module does. The subrequests share the pool, hence the check of request
+ */
+static ngx_http_sticky_ctx_t *
+ngx_http_sticky_get_ctx(ngx_http_request_t *r, ngx_uint_t create)
+{
+    ngx_http_sticky_ctx_t  *ctx;
+    ngx_pool_cleanup_t     *cln;
+
+    ctx = ngx_http_get_module_ctx( r, ngx_http_sticky_lc_module );
+
+    if( ctx ) {
+        return ctx;
+    }
+
+    for( cln = r->pool->cleanup; cln; cln = cln->next ) {
+        if( cln->handler == ngx_http_sticky_ctx_cleanup
+            && ((ngx_http_sticky_ctx_t *) cln->data)->request == r )
+        {
+            ctx = cln->data;
+            ngx_http_set_ctx( r, ctx, ngx_http_sticky_lc_module );
+            return ctx;
+        }
+    }
+
+    if( !create ) {
+        return NULL;
+    }
+
+    cln = ngx_pool_cleanup_add( r->pool, sizeof(ngx_http_sticky_ctx_t) );
+
+    if( NULL == cln ) {
+        return NULL;
+    }
+
+    ctx = cln->data;
+    ngx_memzero( ctx, sizeof(ngx_http_sticky_ctx_t) );
+
+    ctx->request = r;
+
+    cln->handler = ngx_http_sticky_ctx_cleanup;
+
+    ngx_http_set_ctx( r, ctx, ngx_http_sticky_lc_module );
+
+    return ctx;
+}
+
+/*
+ * function called by the upstream module when it inits each peer
+ * it's called once per request
+ */
+static ngx_int_t
+ngx_http_init_sticky_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_sticky_peer_data_t  *iphp;
+    ngx_http_sticky_ctx_t        *ctx;
+    ngx_str_t                     route;
+    ngx_int_t                     n, rc;
+
+    /* alloc custom sticky struct */
+    iphp = ngx_palloc( r->pool, sizeof(ngx_http_sticky_peer_data_t) );
+
+    if( NULL == iphp ) {
+        return NGX_ERROR;
+    }
+
+    /* the request context outlives the peer data, keep it across upstream inits */
+    ctx = ngx_http_sticky_get_ctx( r, 1 );
+
+    if( NULL == ctx ) {
+        return NGX_ERROR;
+    }
+
+    /* a new upstream, a new decision */
+    ctx->set_cookie = NULL;
+    ctx->decided = 1;
+    ctx->outcome = NGX_HTTP_STICKY_OUTCOME_MISS;
+    ctx->peer = -1;
+    ctx->route.len = 0;
+    ctx->lb_alg = 0;
+
+    /* attach it to the request upstream data */
+    r->upstream->peer.data = &iphp->rrp;
+
+    /* call the rr module on which the sticky is based on */
+    if( NGX_OK != ngx_http_upstream_init_round_robin_peer(r, us) ) {
+        return NGX_ERROR;
+    }
+
+    /* set the callbacks to select the next peer to use and to release it */
+    r->upstream->peer.get = ngx_http_get_sticky_peer;
+    r->upstream->peer.free = ngx_http_free_sticky_peer;
+
+    /* init the custom sticky struct */
+    iphp->selected_peer = -1;
+    iphp->route_peer = -1;
+    iphp->spill = 0;
+    iphp->no_fallback = 0;
+    iphp->sticky_conf = ngx_http_conf_upstream_srv_conf( us, ngx_http_sticky_lc_module );
+    iphp->request = r;
+    iphp->ctx = ctx;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    /* the zone peers may have changed since the routes were built */
+    if( NGX_OK != ngx_http_sticky_zone_lock_sync( iphp->sticky_conf, iphp->rrp.peers, r->connection->log ) ) {
+        return NGX_ERROR;
+    }
+
+    iphp->generation = iphp->sticky_conf->zone_generation;
+#endif
+
+    iphp->gate = NULL;
+    iphp->gate_number = iphp->sticky_conf->number;
+
+    if( iphp->sticky_conf->slow_start && NGX_LB_ALG_RR == iphp->sticky_conf->lb_alg ) {
+        iphp->gate = ngx_pcalloc( r->pool, sizeof(uintptr_t)
+                                  * ((iphp->gate_number + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t))) );
+
+        if( NULL == iphp->gate ) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* learn mode, the route is the peer the session was created on */
+    if( iphp->sticky_conf->learn ) {
+        n = ngx_http_sticky_learn_lookup( r, iphp->sticky_conf );
+
+        if( n >= 0 ) {
+            iphp->selected_peer = n;
+            iphp->route_peer = n;
+            ngx_http_sticky_count( iphp->sticky_conf, NGX_HTTP_STICKY_STAT_MATCHED, n );
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                          "[sticky/init_sticky_peer] learned session matches peer at index %i", n);
+        }
+
+        return NGX_OK;
+    }
+
+    /* check weather a route is present or not and save it */
+    rc = ngx_http_sticky_get_route( r, iphp->sticky_conf, &route );
+
+    if( NGX_ERROR == rc ) {
+        return NGX_ERROR;
+    }
+
+    if( NGX_DECLINED != rc ) {
+
+        ngx_http_sticky_count( iphp->sticky_conf, NGX_HTTP_STICKY_STAT_ROUTE, -1 );
+        ctx->route = route;
+
+        /* a route has been found. Let's give it a try */
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                      "[sticky/init_sticky_peer] got cookie route=%V, let's try to find a matching peer", &route);
+
+        /* hash, hmac or text, just compare digest */
+        if( iphp->sticky_conf->hash || iphp->sticky_conf->hmac || iphp->sticky_conf->text ) {
+
+            /* check internal struct has been set */
+            if( NULL == iphp->sticky_conf->peers ) {
+                /* log a warning, as it will continue without the sticky */
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                              "[sticky/init_sticky_peer] internal peers struct has not been set");
+                return NGX_OK; /* return OK, in order to continue */
+            }
+
+            /* look the digest found in the cookie up in the peer digest index */
+            n = ngx_http_sticky_lookup( iphp->sticky_conf, &route );
+
+            if( n >= 0 && n < (ngx_int_t)(iphp->sticky_conf->number + iphp->sticky_conf->backup_number) ) {
+                /* we found a match */
+                iphp->selected_peer = n;
+                iphp->route_peer = n;
+                ngx_http_sticky_count( iphp->sticky_conf, NGX_HTTP_STICKY_STAT_MATCHED, n );
+                ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                              "[sticky/init_sticky_peer] the route \"%V\" matches peer at index %i", &route, n);
+                return NGX_OK;
+            }
+
+        } else {
+
+            /* switch back to index, convert cookie data to integer and ensure it corresponds to a valid peer */
+            n = ngx_atoi( route.data, route.len );
+
+            if( NGX_ERROR == n ) {
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                              "[sticky/init_sticky_peer] unable to convert the route \"%V\" to an integer value", &route);
+            } else if( n >= 0 && n < (ngx_int_t)(iphp->sticky_conf->number + iphp->sticky_conf->backup_number) ) {
+                /* got one valid peer number */
+                ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                              "[sticky/init_sticky_peer] the route \"%V\" matches peer at index %i", &route, n);
+                iphp->selected_peer = n;
+                iphp->route_peer = n;
+                ngx_http_sticky_count( iphp->sticky_conf, NGX_HTTP_STICKY_STAT_MATCHED, n );
+                return NGX_OK;
+            }
+        }
+
+        ngx_http_sticky_count( iphp->sticky_conf, NGX_HTTP_STICKY_STAT_UNMATCHED, -1 );
+        ctx->outcome = NGX_HTTP_STICKY_OUTCOME_INVALID;
+
+        /* found cookie, but no corresponding peer was found, continue with rr */
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                      "[sticky/init_sticky_peer] route \"%V\" doesn't match any peer. Ignoring it ...", &route);
+        return NGX_OK;
+    }
+
+    /* related cookies not found */
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                  "[sticky/init_sticky_peer] route cookie not found", &route);
+    return NGX_OK; /* return OK, in order to continue */
+}
+
+/*
+ * function called by the upstream module to choose the next peer to use
+ * called at least one time per request
+ */
+static ngx_int_t
+ngx_http_get_sticky_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_sticky_peer_data_t  *iphp = data;
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+
+    ngx_int_t                     selected_peer = -1;
+    time_t                        now = ngx_time();
+    uintptr_t                     m = 0;
+    ngx_uint_t                    n = 0;
+    ngx_int_t                     k, rc;
+    ngx_uint_t                    failover, reissue, load_conns, load_weight;
+    ngx_uint_t                    copy = 0;
+    ngx_http_upstream_rr_peer_t  *peer = NULL;
+    ngx_http_upstream_rr_peers_t *peers;
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                  "[sticky/get_sticky_peer] get sticky peer, try: %ui, n_peers: %ui, no_fallback: %ui/%ui",
+                  pc->tries, iphp->rrp.peers->number, conf->no_fallback, iphp->no_fallback);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    /*
+     * another request of this worker rebuilt the routes since this one was
+     * set up, a retry would use the indexes and tried bits of the old
+     * table: give up, as the round robin module does when the zone changed
+     */
+    if( iphp->generation != conf->zone_generation ) {
+        ngx_log_error(NGX_LOG_INFO, pc->log, 0,
+                      "[sticky/get_sticky_peer] the routes changed since the request was set up");
+        iphp->selected_peer = -1;
+        iphp->route_peer = -1;
+        return NGX_BUSY;
+    }
+#endif
+
+    if( iphp->selected_peer >= 0  /* has got a selected peer */
+            && iphp->selected_peer < (ngx_int_t)conf->number /* legal peer number */
+            && !iphp->rrp.peers->single ) { /* has multiple peers */
+
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                      "[sticky/get_sticky_peer] let's try the selected peer (%i)", iphp->selected_peer);
+
+        /* whether selected_peer has been tried */
+        n = iphp->selected_peer / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << iphp->selected_peer % (8 * sizeof(uintptr_t)); /* get 0001 0010 0100 1000 from 0 1 2 3 */
+
+        if( 0 == (iphp->rrp.tried[n] & m) ) {
+            peers = iphp->rrp.peers;
+            peer = conf->peers[iphp->selected_peer].rr_peer;
+
+            /*
+             * in a shared zone the peer is updated by every worker,
+             * the round robin module frees it under the same locks
+             */
+            ngx_http_upstream_rr_peers_rlock(peers);
+            ngx_http_upstream_rr_peer_lock(peers, peer);
+
+            /* the active health check knows better than a connect attempt */
+            if( peer->down || ngx_http_sticky_check_down(conf, iphp->selected_peer) ) {
+                ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_DOWN, iphp->selected_peer );
+
+                if( conf->no_fallback ) {
+                    iphp->no_fallback = 1;
+                    ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_BUSY, iphp->selected_peer );
+                    ngx_http_upstream_rr_peer_unlock(peers, peer);
+                    ngx_http_upstream_rr_peers_unlock(peers);
+                    ngx_log_error(NGX_LOG_NOTICE, pc->log, 0,
+                                  "[sticky/get_sticky_peer] selected peer is down and no_fallback is flagged");
+                    iphp->ctx->outcome = NGX_HTTP_STICKY_OUTCOME_BUSY;
+                    return NGX_BUSY;
+                }
+
+                /* mark as tried in bitmap, and fall back */
+                iphp->rrp.tried[n] |= m;
+
+            } else {
+
+                if( conf->no_fallback ) {
+                    /* if enabled no_fallback ，server will return 504 when upstream is invalid */
+                    iphp->no_fallback = 1;
+
+                    /* reset fail_timeout after kicking out peer for enough time */
+                    if( (now - peer->accessed) > peer->fail_timeout ) {
+                        peer->fails = 0;
+                    }
+
+                    /* peer failed */
+                    if( peer->max_fails > 0 && (peer->fails >= peer->max_fails) ) {
+                        ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_DOWN, iphp->selected_peer );
+                        ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_BUSY, iphp->selected_peer );
+                        ngx_http_upstream_rr_peer_unlock(peers, peer);
+                        ngx_http_upstream_rr_peers_unlock(peers);
+                        ngx_log_error(NGX_LOG_NOTICE, pc->log, 0,
+                                      "[sticky/get_sticky_peer] selected peer is maked as failed ,no_fallback is flagged");
+                        iphp->ctx->outcome = NGX_HTTP_STICKY_OUTCOME_BUSY;
+                        return NGX_BUSY;
+                    }
+                }
+
+                if( 0 == peer->max_fails || (peer->fails < peer->max_fails) ){
+                    selected_peer = iphp->selected_peer;
+                }
+                else if( (now - peer->accessed) > peer->fail_timeout) {
+                    peer->fails = 0;
+                    selected_peer = iphp->selected_peer;
+                }
+                /* peer is max_fails or time is less than fail_timeout */
+                else {
+                    /* mark as tried in bitmap */
+                    iphp->rrp.tried[n] |= m;
+                    ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_DOWN, iphp->selected_peer );
+                }
+
+#if defined(nginx_version) && nginx_version >= 1011005
+                /* full: it falls back, or with no_fallback the request is turned down below */
+                if( selected_peer >= 0 && peer->max_conns && peer->conns >= peer->max_conns ) {
+                    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                                  "[sticky/get_sticky_peer] selected peer (%i) reached max_conns", selected_peer);
+                    iphp->rrp.tried[n] |= m;
+                    selected_peer = -1;
+                }
+#endif
+
+                /* too many sessions on it, this request goes elsewhere but keeps its cookie */
+                if( selected_peer >= 0 && conf->max_load_factor ) {
+                    ngx_http_sticky_load( conf, &load_conns, &load_weight );
+
+                    if( ngx_http_sticky_overloaded(conf, selected_peer, load_conns, load_weight) ) {
+                        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                                      "[sticky/get_sticky_peer] selected peer (%i) is over max_load_factor, spill over",
+                                      selected_peer);
+                        ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_SPILL, selected_peer );
+                        iphp->rrp.tried[n] |= m;
+                        iphp->spill = 1;
+                        selected_peer = -1;
+                    }
+                }
+
+                if( selected_peer >= 0 ) {
+                    peer->conns ++;
+                }
+            }
+
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
+            ngx_http_upstream_rr_peers_unlock(peers);
+        }
+
+    } else if( iphp->selected_peer >= (ngx_int_t)conf->number /* a backup peer */
+            && iphp->selected_peer < (ngx_int_t)(conf->number + conf->backup_number)
+            && !iphp->rrp.peers->single ) {
+
+        rc = ngx_http_sticky_get_backup_peer( pc, iphp );
+
+        if( NGX_OK == rc ) {
+            iphp->start = ngx_current_msec;
+            iphp->sticky = 1;
+            iphp->ctx->outcome = NGX_HTTP_STICKY_OUTCOME_HIT;
+            iphp->ctx->peer = iphp->selected_peer;
+            iphp->ctx->lb_alg = 0;
+            iphp->selected_peer = -1;
+            return NGX_OK;
+        }
+
+        if( NGX_BUSY == rc ) {
+            ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_DOWN, iphp->selected_peer );
+
+            /* the load-balancing algorithm below returns NGX_BUSY */
+            if( conf->no_fallback ) {
+                iphp->no_fallback = 1;
+            }
+        }
+    }
+
+    /* have a valid peer, tell the upstream module to use it */
+    if( peer && selected_peer >= 0 ) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                      "[sticky/get_sticky_peer] peer found at index %i", selected_peer);
+
+#if defined(nginx_version) && nginx_version >= 1009000
+        iphp->rrp.current = peer;
+#else
+        iphp->rrp.current = iphp->selected_peer;
+#endif
+        /* save peer to peer connection ,done */
+        pc->cached = 0;
+        pc->connection = NULL;
+        pc->sockaddr = peer->sockaddr;
+        pc->socklen = peer->socklen;
+        pc->name = &peer->name;
+
+        /* mark as tried, conns has been counted under the peer lock */
+        iphp->rrp.tried[n] |= m;
+
+        iphp->start = ngx_current_msec;
+        iphp->sticky = 1;
+
+        iphp->ctx->outcome = NGX_HTTP_STICKY_OUTCOME_HIT;
+        iphp->ctx->peer = selected_peer;
+        iphp->ctx->lb_alg = 0;
+
+        if( conf->lc_heap ) {
+            ngx_http_sticky_lc_update( conf, iphp->selected_peer );
+        }
+
+    }
+    /* peer is NULL or selected_peer == -1 means that no previous peer is valid */
+    else {
+        ngx_int_t ret = NGX_ERROR;
+
+        /* check fallback flag */
+        if( iphp->no_fallback ) {
+            ngx_log_error(NGX_LOG_NOTICE, pc->log, 0, "[sticky/get_sticky_peer] No fallback in action !");
+            ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_BUSY, -1 );
+            iphp->ctx->outcome = NGX_HTTP_STICKY_OUTCOME_BUSY;
+            return NGX_BUSY;
+        }
+
+        /* the peer of the route failed, its sessions go where hrw says */
+        failover = !iphp->spill && NGX_HTTP_STICKY_FAILOVER_HRW == conf->failover && iphp->route_peer >= 0;
+
+        if( iphp->spill ) {
+
+            /* the same alternative for every request of the overloaded peer */
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_hrw] SPILL_HRW ");
+
+            ret = ngx_http_upstream_get_hrw_peer( pc, iphp );
+
+        } else if( failover ) {
+
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_hrw] FAILOVER_HRW ");
+
+            if( 0 == conf->peers[iphp->route_peer].down_since ) {
+                conf->peers[iphp->route_peer].down_since = now;
+            }
+
+            ret = ngx_http_upstream_get_hrw_peer( pc, iphp );
+
+        } else if( NGX_LB_ALG_RR == conf->lb_alg ) {
+
+            iphp->lb_alg = NGX_LB_ALG_RR;
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_rr] LB_RR ");
+
+            if( iphp->gate ) {
+                ngx_http_sticky_slow_start_gate( iphp, now );
+            }
+
+            ret = ngx_http_upstream_get_round_robin_peer( pc, &iphp->rrp );
+
+            /* the peers held back may be tried next time, unless it moved to the backup ones */
+            if( iphp->gate && iphp->rrp.peers->peer == conf->peers[0].rr_peer ) {
+                for( n = 0; n < (iphp->gate_number + (8 * sizeof(uintptr_t) - 1)) / (8 * sizeof(uintptr_t)); n++ ) {
+                    iphp->rrp.tried[n] &= ~iphp->gate[n];
+                }
+            }
+
+        } else if( NGX_LB_ALG_LC == conf->lb_alg ) {
+
+            iphp->lb_alg = NGX_LB_ALG_LC;
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_lc] LB_LC ");
+
+            ret = ngx_http_upstream_get_least_conn_peer( pc, &iphp->rrp );
+
+        } else if( NGX_LB_ALG_P2C == conf->lb_alg ) {
+
+            iphp->lb_alg = NGX_LB_ALG_P2C;
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_p2c] LB_P2C ");
+
+            ret = ngx_http_upstream_get_p2c_peer( pc, iphp );
+
+        } else if( NGX_LB_ALG_CHASH == conf->lb_alg ) {
+
+            iphp->lb_alg = NGX_LB_ALG_CHASH;
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_chash] LB_CHASH ");
+
+            ret = ngx_http_upstream_get_chash_peer( pc, iphp );
+
+        } else if( NGX_LB_ALG_RANDOM == conf->lb_alg ) {
+
+            iphp->lb_alg = NGX_LB_ALG_RANDOM;
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_random] LB_RANDOM ");
+
+            ret = ngx_http_upstream_get_random_peer( pc, iphp );
+
+        } else if( NGX_LB_ALG_EWMA == conf->lb_alg ) {
+
+            iphp->lb_alg = NGX_LB_ALG_EWMA;
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_ewma] LB_EWMA ");
+
+            ret = ngx_http_upstream_get_ewma_peer( pc, iphp );
+
+        } else {
+            return NGX_BUSY;
+        }
+
+        if( NGX_OK != ret ) {
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                           "[sticky/get_sticky_peer_rr] ngx_http_upstream_get_round_robin_peer returned %i", ret);
             return ret;
         }
 
-        /* search for the choosen peer in order to set the cookie */
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_sticky_peer_lc] get cookie 0");
+        /* the load-balancing algorithm left the choosen peer in rrp.current */
+        k = ngx_http_sticky_peer_index( conf, iphp->rrp.current );
+
+        iphp->start = ngx_current_msec;
+        iphp->sticky = 0;
+
+        /* a route was followed before, or it led to a peer which can't take the request */
+        if( iphp->route_peer >= 0 ) {
+            iphp->ctx->outcome = NGX_HTTP_STICKY_OUTCOME_FALLBACK;
+        }
+
+        iphp->ctx->peer = k;
+        iphp->ctx->lb_alg = (iphp->spill || failover) ? NGX_HTTP_STICKY_LB_HRW : conf->lb_alg;
+
+        /* a spill over has been counted already */
+        if( !iphp->spill ) {
+            ngx_http_sticky_count( conf, failover ? NGX_HTTP_STICKY_STAT_FAILOVER
+                                                  : NGX_HTTP_STICKY_STAT_FALLBACK + conf->lb_alg - NGX_LB_ALG_RR, k );
+        }
+
+        /*
+         * with failover_reissue=, a flapping peer keeps its sessions: the
+         * cookie only moves once it has been failing long enough. Routes to
+         * a backup peer move as soon as a primary one is back
+         */
+        reissue = !iphp->spill
+                  && (!failover || 0 == conf->failover_reissue || iphp->route_peer >= (ngx_int_t) conf->number
+                      || now - conf->peers[iphp->route_peer].down_since >= conf->failover_reissue);
+
+        /* with learn or route=, the backends carry the route, no cookie is needed */
+        if( k >= 0 && reissue && NULL == conf->learn && NULL == conf->route && conf->peers[k].cookie.value.len ) {
+            /*
+             * the Set-Cookie value has been built at init, just emit it.
+             * Routes rebuilt for a zone are freed at the next rebuild,
+             * maybe before the response is sent: the value is copied then
+             */
+#if (NGX_HTTP_UPSTREAM_ZONE)
+            copy = NULL != conf->zone_pool;
+#endif
+            ngx_http_sticky_misc_set_cookie(iphp->request, &iphp->ctx->set_cookie, &conf->peers[k].cookie,
+                                            conf->cookie_expires, copy);
+            ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_COOKIE, k );
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                          "[sticky/get_sticky_peer] set cookie \"%V\" index=%i",
+                          &conf->peers[k].cookie.value, k);
+        }
+    }
+
+    /* reset the selection in order to bypass the sticky module
+     * when the upstream module will try another peers if necessary */
+    iphp->selected_peer = -1;
+
+    return NGX_OK;
+}
+static ngx_int_t
+ngx_http_upstream_get_least_conn_peer( ngx_peer_connection_t *pc, void *data )
+{
+    ngx_http_upstream_rr_peer_data_t *rrp = data;
+    ngx_http_sticky_peer_data_t      *iphp = data;
+
+    time_t                        now = ngx_time();
+    ngx_int_t                     rc = NGX_ERROR;
+    ngx_uint_t                    n = 0, i;
+    ngx_uint_t                    p, r, best_r, start, ramp, w, best_w, base;
+    ngx_http_upstream_rr_peer_t  *peer = NULL, *best = NULL;
+    ngx_http_upstream_rr_peers_t *peers = NULL;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            "[sticky/get_least_conn_peer] get least conn peer, try: %ui", pc->tries);
+
+    if ( rrp->peers->single ) {
+        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    }
+
+    /* primary peers of a large upstream, the heap knows the least loaded one */
+    if( iphp->sticky_conf->lc_heap && rrp->peers->peer == iphp->sticky_conf->peers[0].rr_peer ) {
+        rc = ngx_http_sticky_get_lc_heap_peer( pc, iphp );
+
+        if( NGX_BUSY != rc || NULL == rrp->peers->next ) {
+            return rc;
+        }
+
+        /* no primary peer left, let the scan below switch to the backup servers */
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    peers = rrp->peers;   /* get all peers from upstream */
+
+    /* none of the servers resolved, or no backup server did */
+    if( 0 == peers->number ) {
+        goto failed;
+    }
+
+    /*
+     * the scan only reads the peers: ties go to the first peer after a
+     * rotating start instead of the smooth weighted round robin, which
+     * would write every tied peer. Only the chosen one is locked.
+     */
+    start = iphp->sticky_conf->lc_seq++ % peers->number;
+
+    /* slow_start= scales the weights of the primary peers */
+    /* where the peers scanned are in conf->peers, for the health check */
+    base = peers->peer == iphp->sticky_conf->peers[0].rr_peer ? 0 : iphp->sticky_conf->number;
+
+    ramp = iphp->sticky_conf->slow_start != 0 && peers->peer == iphp->sticky_conf->peers[0].rr_peer
+           && peers->number == iphp->sticky_conf->number;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+again:
+
+#if( NGX_SUPPRESS_WARN )
+    p = 0;
+    best_r = 0;
+    best_w = 0;
+#endif
+
+    best = NULL;
+
+    /* traversal all valid peer and get a best peer with weighted least conns */
+    for(peer = peers->peer, i = 0;
+            peer;
+            peer = peer->next, i++) {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            "[sticky/get_least_conn_peer] peer no: %ui peer conns: %ui peer weight: %ui", i,  peer->conns, peer->weight );
+
+        w = ramp ? peer->weight * ngx_http_sticky_slow_start_weight(iphp->sticky_conf, i, now) : peer->weight;
+
+        if( !ngx_http_sticky_peer_usable(rrp, peer, i, now) || ngx_http_sticky_check_down(iphp->sticky_conf, base + i) ) {
+            continue;
+        }
+
+        r = (i + peers->number - start) % peers->number;
+
+        /*
+         * select peer with least number of connections; if there are
+         * multiple peers with the same number of connections, select
+         * the first one from start. While ramping up, the connection
+         * about to be made counts, else an idle peer would take them all
+         */
+        if( NULL == best
+                || (peer->conns + ramp) * best_w < (best->conns + ramp) * w
+                || ((peer->conns + ramp) * best_w == (best->conns + ramp) * w && r < best_r) ) {
+            best = peer;
+            p = i;
+            best_r = r;
+            best_w = w;
+        }
+    }
+
+    if( NULL == best ) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "[sticky/get_least_conn_peer] no least conn peer found");
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        goto failed;
+    }
+
+    ngx_http_upstream_rr_peer_lock(peers, best);
+
+#if defined(nginx_version) && nginx_version >= 1011005
+    /* another worker took the last connection meanwhile */
+    if( best->max_conns && best->conns >= best->max_conns ) {
+        ngx_http_upstream_rr_peer_unlock(peers, best);
+        rrp->tried[p / (8 * sizeof(uintptr_t))] |= (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+        goto again;
+    }
+#endif
+
+    ngx_http_sticky_use_peer( pc, rrp, best, p, now );
+
+    ngx_http_upstream_rr_peer_unlock(peers, best);
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_least_conn_peer] set selected_peer as %ui", p);
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return NGX_OK;
+
+failed:
+
+    if( peers->next ) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                        "[sticky/get_least_conn_peer] get least conn peer, backup servers");
+
+        rrp->peers = peers->next;
+        n = ( rrp->peers->number+(8*sizeof(uintptr_t)-1) ) / (8 * sizeof(uintptr_t));
+
+        for(i = 0; i < n; i++) {
+            rrp->tried[i] = 0;
+        }
+
+        /*
+         * scan the backup servers, not through ngx_http_get_sticky_peer()
+         * which would count the fallback and emit the cookie a second time
+         */
+        rc = ngx_http_upstream_get_least_conn_peer(pc, rrp);
+
+        if( NGX_BUSY != rc ) {
+            return rc;
+        }
+    }
+
+    pc->name = peers->name;
+
+    return NGX_BUSY;
+}
+
+/*
+ * function called by the upstream module when it's done with a peer
+ * the round robin module does the accounting, the sticky module
+ * only follows the conns change
+ */
+static void
+ngx_http_free_sticky_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state)
+{
+    ngx_http_sticky_peer_data_t  *iphp = data;
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peer_t  *peer = iphp->rrp.current;
+    ngx_int_t                     k;
+
+    k = NGX_DECLINED;
+
+    if( peer && (conf->learn || conf->stats || conf->failover_reissue || conf->waiting
+                 || NGX_LB_ALG_EWMA == conf->lb_alg) ) {
+        k = ngx_http_sticky_peer_index( conf, peer );
+
+        /* the peer serves again, its sessions won't move */
+        if( conf->failover_reissue && k >= 0 && !(state & NGX_PEER_FAILED) ) {
+            conf->peers[k].down_since = 0;
+        }
+
+        /* every response feeds the average, whoever picked the peer */
+        if( NGX_LB_ALG_EWMA == conf->lb_alg && k >= 0 ) {
+            ngx_http_sticky_ewma_update( iphp, k, state & NGX_PEER_FAILED );
+        }
+
+        if( conf->stats ) {
+            ngx_http_sticky_record( conf, k, iphp->sticky, ngx_current_msec - iphp->start, state & NGX_PEER_FAILED );
+        }
+
+        /* the response is done, remember the peer of the session it created */
+        if( conf->learn && k >= 0 && !(state & NGX_PEER_FAILED) ) {
+            ngx_http_sticky_learn_store( iphp->request, conf, k );
+        }
+    }
+
+    ngx_http_upstream_free_round_robin_peer( pc, &iphp->rrp, state );
+
+    /* a connection to the peer is released, the request waiting the longest for it goes on */
+    if( k >= 0 && !ngx_queue_empty(&conf->peers[k].waiting) ) {
+        ngx_http_sticky_queue_wake( ngx_queue_data(ngx_queue_head(&conf->peers[k].waiting), ngx_http_sticky_ctx_t, queue) );
+    }
+
+    /* the peer has one connection less, move it up in the heap */
+    if( conf->lc_heap && peer
+            && peer >= conf->peers[0].rr_peer && peer < conf->peers[0].rr_peer + conf->number ) {
+        ngx_http_sticky_lc_update( conf, peer - conf->peers[0].rr_peer );
+    }
+}
+
+/*
+ * least conn heap order: lower conns / weight first, then the peer
+ * picked the longest time ago, which gives round robin between equals
+ */
+static ngx_inline ngx_int_t
+ngx_http_sticky_lc_less(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t a, ngx_uint_t b)
+{
+    ngx_http_upstream_rr_peer_t  *pa = conf->peers[a].rr_peer;
+    ngx_http_upstream_rr_peer_t  *pb = conf->peers[b].rr_peer;
+
+    if( pa->conns * pb->weight != pb->conns * pa->weight ) {
+        return pa->conns * pb->weight < pb->conns * pa->weight;
+    }
+
+    return conf->peers[a].seq < conf->peers[b].seq;
+}
+
+static ngx_inline void
+ngx_http_sticky_lc_swap(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t h1, ngx_uint_t h2)
+{
+    ngx_uint_t  i = conf->lc_heap[h1];
+
+    conf->lc_heap[h1] = conf->lc_heap[h2];
+    conf->lc_heap[h2] = i;
+
+    conf->peers[conf->lc_heap[h1]].heap = h1;
+    conf->peers[conf->lc_heap[h2]].heap = h2;
+}
+
+/*
+ * alloc the heap, all peers start with no connection
+ */
+static ngx_int_t
+ngx_http_sticky_lc_init(ngx_conf_t *cf, ngx_http_sticky_srv_conf_t *conf)
+{
+    ngx_uint_t  i;
+
+    conf->lc_heap = ngx_palloc( cf->pool, sizeof(ngx_uint_t) * conf->number );
+    conf->lc_stack = ngx_palloc( cf->pool, sizeof(ngx_uint_t) * conf->number );
+
+    if( NULL == conf->lc_heap || NULL == conf->lc_stack ) {
+        return NGX_ERROR;
+    }
+
+    for( i = 0; i < conf->number; i++ ) {
+        conf->lc_heap[i] = i;
+        conf->peers[i].heap = i;
+        conf->peers[i].seq = 0;
+    }
+
+    conf->lc_seq = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * restore the heap order after the conns or the seq of peer i changed
+ */
+static void
+ngx_http_sticky_lc_update(ngx_http_sticky_srv_conf_t *conf, ngx_uint_t i)
+{
+    ngx_uint_t  h, child;
+
+    /* sift up */
+    for( h = conf->peers[i].heap;
+            h > 0 && ngx_http_sticky_lc_less(conf, i, conf->lc_heap[(h - 1) / 2]);
+            h = (h - 1) / 2 ) {
+        ngx_http_sticky_lc_swap( conf, h, (h - 1) / 2 );
+    }
+
+    /* sift down */
+    for( ;; ) {
+        child = 2 * h + 1;
+
+        if( child >= conf->number ) {
+            break;
+        }
+
+        if( child + 1 < conf->number
+                && ngx_http_sticky_lc_less(conf, conf->lc_heap[child + 1], conf->lc_heap[child]) ) {
+            child++;
+        }
+
+        if( !ngx_http_sticky_lc_less(conf, conf->lc_heap[child], i) ) {
+            break;
+        }
+
+        ngx_http_sticky_lc_swap( conf, h, child );
+        h = child;
+    }
+}
+
+/*
+ * pick the least conn primary peer out of the heap
+ * the search only goes below the peers that can't be used (tried, down,
+ * failed or full), so it usually stops at the top of the heap
+ */
+static ngx_int_t
+ngx_http_sticky_get_lc_heap_peer(ngx_peer_connection_t *pc, ngx_http_sticky_peer_data_t *iphp)
+{
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+
+    time_t                        now = ngx_time();
+    ngx_uint_t                    h, i, sp;
+    ngx_int_t                     best = -1;
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    sp = 0;
+    conf->lc_stack[sp++] = 0;
+
+    while( sp ) {
+        h = conf->lc_stack[--sp];
+        i = conf->lc_heap[h];
+
+        /* the whole subtree is more loaded than the best peer found so far */
+        if( best >= 0 && !ngx_http_sticky_lc_less(conf, i, best) ) {
+            continue;
+        }
+
+        if( !ngx_http_sticky_peer_usable(&iphp->rrp, conf->peers[i].rr_peer, i, now) || ngx_http_sticky_check_down(conf, i) ) {
+            /* not usable, its children may be */
+            if( 2 * h + 1 < conf->number ) {
+                conf->lc_stack[sp++] = 2 * h + 1;
+            }
+
+            if( 2 * h + 2 < conf->number ) {
+                conf->lc_stack[sp++] = 2 * h + 2;
+            }
+
+            continue;
+        }
+
+        best = i;
+    }
+
+    if( best < 0 ) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "[sticky/get_lc_heap_peer] no least conn peer found");
+        pc->name = iphp->rrp.peers->name;
+        return NGX_BUSY;
+    }
+
+    ngx_http_sticky_use_peer( pc, &iphp->rrp, conf->peers[best].rr_peer, best, now );
+
+    /* it has one more connection and is now the latest picked, move it down */
+    conf->peers[best].seq = ++conf->lc_seq;
+    ngx_http_sticky_lc_update( conf, best );
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_lc_heap_peer] picked peer %i", best);
+
+    return NGX_OK;
+}
+
+/*
+ * power of two choices: draw two usable peers at random and keep the one
+ * with fewer weighted conns. It's O(1) and, unlike least conn, doesn't
+ * make every worker rush to the same peer when their views are stale
+ */
+static ngx_int_t
+ngx_http_upstream_get_p2c_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_sticky_peer_data_t  *iphp = data;
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peers_t *peers = iphp->rrp.peers;
+    ngx_http_upstream_rr_peer_t  *a, *b;
+
+    time_t                        now = ngx_time();
+    ngx_uint_t                    i, ia, ib, tries;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            "[sticky/get_p2c_peer] get p2c peer, try: %ui", pc->tries);
+
+    if( peers->single ) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &iphp->rrp);
+    }
+
+    /* the peers can only be drawn by index out of the primary array, if any resolved */
+    if( 0 == conf->number || peers->peer != conf->peers[0].rr_peer ) {
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    /* the draws only read the peers, only the chosen one is locked */
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    a = NULL;
+    b = NULL;
+    ia = 0;
+    ib = 0;
+
+    for( tries = 0; tries < NGX_HTTP_STICKY_P2C_TRIES && NULL == b; tries++ ) {
+        i = ngx_random() % conf->number;
+
+        if( (a && i == ia) || !ngx_http_sticky_peer_usable(&iphp->rrp, conf->peers[i].rr_peer, i, now)
+            || ngx_http_sticky_check_down(conf, i) )
+        {
+            continue;
+        }
+
+        if( NULL == a ) {
+            a = conf->peers[i].rr_peer;
+            ia = i;
+
+        } else {
+            b = conf->peers[i].rr_peer;
+            ib = i;
+        }
+    }
+
+    /* most peers are unusable, let least conn scan them all */
+    if( NULL == a ) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "[sticky/get_p2c_peer] no usable peer drawn, scanning");
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
+
+    if( b && b->conns * a->weight < a->conns * b->weight ) {
+        a = b;
+        ia = ib;
+    }
+
+    ngx_http_upstream_rr_peer_lock(peers, a);
+
+#if defined(nginx_version) && nginx_version >= 1011005
+    /* another worker took the last connection meanwhile */
+    if( a->max_conns && a->conns >= a->max_conns ) {
+        ngx_http_upstream_rr_peer_unlock(peers, a);
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        iphp->rrp.tried[ia / (8 * sizeof(uintptr_t))] |= (uintptr_t) 1 << ia % (8 * sizeof(uintptr_t));
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
+#endif
+
+    ngx_http_sticky_use_peer( pc, &iphp->rrp, a, ia, now );
+
+    ngx_http_upstream_rr_peer_unlock(peers, a);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_p2c_peer] picked peer %ui", ia);
+
+    return NGX_OK;
+}
+
+static int ngx_libc_cdecl
+ngx_http_sticky_chash_cmp_points(const void *one, const void *two)
+{
+    ngx_http_sticky_chash_point_t  *first = (ngx_http_sticky_chash_point_t *) one;
+    ngx_http_sticky_chash_point_t  *second = (ngx_http_sticky_chash_point_t *) two;
+
+    if( first->hash < second->hash ) {
+        return -1;
+    }
+
+    if( first->hash > second->hash ) {
+        return 1;
+    }
+
+    /* same hash for two servers, keep the ring the same across reloads */
+    return (first->peer > second->peer) - (first->peer < second->peer);
+}
+
+/*
+ * build the ketama ring: NGX_HTTP_STICKY_CHASH_POINTS points per unit of
+ * weight, hashed from the server address so that adding or removing
+ * a server only remaps the keys of its own points
+ */
+static ngx_int_t
+ngx_http_sticky_chash_init(ngx_pool_t *pool, ngx_http_sticky_srv_conf_t *conf)
+{
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_uint_t                    i, j, n, npoints;
+    uint32_t                      hash, point;
+
+    npoints = 0;
+
+    for( i = 0; i < conf->number; i++ ) {
+        npoints += conf->peers[i].rr_peer->weight * NGX_HTTP_STICKY_CHASH_POINTS;
+    }
+
+    conf->chash_points = ngx_palloc( pool, sizeof(ngx_http_sticky_chash_point_t) * npoints );
+
+    if( NULL == conf->chash_points ) {
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    for( i = 0; i < conf->number; i++ ) {
+        peer = conf->peers[i].rr_peer;
+
+        for( j = 0; j < peer->weight * NGX_HTTP_STICKY_CHASH_POINTS; j++ ) {
+            point = (uint32_t) j;
+
+            ngx_crc32_init(hash);
+            ngx_crc32_update(&hash, peer->name.data, peer->name.len);
+            ngx_crc32_update(&hash, (u_char *) &point, sizeof(uint32_t));
+            ngx_crc32_final(hash);
+
+            conf->chash_points[n].hash = hash;
+            conf->chash_points[n].peer = i;
+            n++;
+        }
+    }
+
+    ngx_qsort( conf->chash_points, npoints, sizeof(ngx_http_sticky_chash_point_t),
+               ngx_http_sticky_chash_cmp_points );
+
+    conf->chash_number = npoints;
+
+    return NGX_OK;
+}
+
+/*
+ * consistent hash: the key lands on the ring, the first usable peer
+ * clockwise is used, so a client without cookie keeps the same peer
+ */
+static ngx_int_t
+ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_sticky_peer_data_t  *iphp = data;
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peers_t *peers = iphp->rrp.peers;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    time_t                        now = ngx_time();
+    ngx_str_t                     key;
+    ngx_uint_t                    k, lo, hi, mid, tries;
+    uint32_t                      hash;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            "[sticky/get_chash_peer] get chash peer, try: %ui", pc->tries);
+
+    /* the ring only knows the primary array, leave the rest to round robin */
+    if( peers->single || peers->peer != conf->peers[0].rr_peer || 0 == conf->chash_number ) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &iphp->rrp);
+    }
+
+    if( NGX_OK != ngx_http_complex_value(iphp->request, conf->chash_key, &key) ) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_long( key.data, key.len );
+
+    /* find the first point at or after the key */
+    lo = 0;
+    hi = conf->chash_number;
+
+    while( lo < hi ) {
+        mid = lo + (hi - lo) / 2;
+
+        if( conf->chash_points[mid].hash < hash ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for( tries = 0; tries < NGX_HTTP_STICKY_CHASH_TRIES; tries++ ) {
+        k = conf->chash_points[(lo + tries) % conf->chash_number].peer;
+        peer = conf->peers[k].rr_peer;
+
+        if( !ngx_http_sticky_peer_usable(&iphp->rrp, peer, k, now) || ngx_http_sticky_check_down(conf, k) ) {
+            continue;
+        }
+
+        ngx_http_upstream_rr_peer_lock(peers, peer);
+
+#if defined(nginx_version) && nginx_version >= 1011005
+        if( peer->max_conns && peer->conns >= peer->max_conns ) {
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
+            continue;
+        }
+#endif
+
+        ngx_http_sticky_use_peer( pc, &iphp->rrp, peer, k, now );
+
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                      "[sticky/get_chash_peer] key \"%V\" picked peer %ui", &key, k);
+
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "[sticky/get_chash_peer] no usable peer near the key, round robin");
+
+    return ngx_http_upstream_get_round_robin_peer(pc, &iphp->rrp);
+}
+
+/*
+ * sticky learn: the shared zone keeps session -> peer, ordered by the
+ * crc32 of the session in a rbtree and by last use in a queue, which
+ * bounds the zone: the least recently used sessions are dropped first
+ */
+static void
+ngx_http_sticky_learn_rbtree_insert_value(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t             **p;
+    ngx_http_sticky_learn_node_t   *ln, *lnt;
+
+    for( ;; ) {
+
+        if( node->key < temp->key ) {
+            p = &temp->left;
+
+        } else if( node->key > temp->key ) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            ln = (ngx_http_sticky_learn_node_t *) &node->color;
+            lnt = (ngx_http_sticky_learn_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(ln->data, lnt->data, ln->len, lnt->len) < 0) ? &temp->left : &temp->right;
+        }
+
+        if( *p == sentinel ) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+static ngx_int_t
+ngx_http_sticky_learn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_sticky_learn_t  *olearn = data;
+    ngx_http_sticky_learn_t  *learn = shm_zone->data;
+    size_t                    len;
+
+    /* reload, keep the sessions learned so far */
+    if( olearn ) {
+        learn->sh = olearn->sh;
+        learn->shpool = olearn->shpool;
+        return NGX_OK;
+    }
+
+    learn->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if( shm_zone->shm.exists ) {
+        learn->sh = learn->shpool->data;
+        return NGX_OK;
+    }
+
+    learn->sh = ngx_slab_alloc( learn->shpool, sizeof(ngx_http_sticky_learn_shctx_t) );
+
+    if( NULL == learn->sh ) {
+        return NGX_ERROR;
+    }
+
+    learn->shpool->data = learn->sh;
+
+    ngx_rbtree_init( &learn->sh->rbtree, &learn->sh->sentinel, ngx_http_sticky_learn_rbtree_insert_value );
+    ngx_queue_init( &learn->sh->queue );
+
+    len = sizeof(" in sticky learn zone \"\"") + shm_zone->shm.name.len;
+
+    learn->shpool->log_ctx = ngx_slab_alloc( learn->shpool, len );
+
+    if( NULL == learn->shpool->log_ctx ) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf( learn->shpool->log_ctx, " in sticky learn zone \"%V\"%Z", &shm_zone->shm.name );
+
+    return NGX_OK;
+}
+
+/*
+ * find a session, called with the zone locked
+ */
+static ngx_http_sticky_learn_node_t *
+ngx_http_sticky_learn_find(ngx_http_sticky_learn_t *learn, uint32_t hash, u_char *data, size_t len)
+{
+    ngx_rbtree_node_t             *node, *sentinel;
+    ngx_http_sticky_learn_node_t  *ln;
+    ngx_int_t                      rc;
+
+    node = learn->sh->rbtree.root;
+    sentinel = learn->sh->rbtree.sentinel;
+
+    while( node != sentinel ) {
+
+        if( hash < node->key ) {
+            node = node->left;
+            continue;
+        }
+
+        if( hash > node->key ) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        ln = (ngx_http_sticky_learn_node_t *) &node->color;
+
+        rc = ngx_memn2cmp( data, ln->data, len, (size_t) ln->len );
+
+        if( 0 == rc ) {
+            return ln;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * drop at most two sessions idle for longer than the timeout;
+ * with n = 0, the least recently used one goes first whatever its age
+ * called with the zone locked
+ */
+static void
+ngx_http_sticky_learn_expire(ngx_http_sticky_learn_t *learn, time_t now, ngx_uint_t n)
+{
+    ngx_queue_t                   *q;
+    ngx_rbtree_node_t             *node;
+    ngx_http_sticky_learn_node_t  *ln;
+
+    while( n < 3 ) {
+
+        if( ngx_queue_empty(&learn->sh->queue) ) {
+            return;
+        }
+
+        q = ngx_queue_last( &learn->sh->queue );
+        ln = ngx_queue_data( q, ngx_http_sticky_learn_node_t, queue );
+
+        if( n++ != 0 && now - ln->last <= learn->timeout ) {
+            return;
+        }
+
+        ngx_queue_remove( q );
+
+        node = (ngx_rbtree_node_t *) ((u_char *) ln - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete( &learn->sh->rbtree, node );
+        ngx_slab_free_locked( learn->shpool, node );
+    }
+}
+
+/*
+ * resolve the session of a request to a peer index, NGX_DECLINED if it's
+ * unknown, expired or its peer is gone. Nothing is allocated.
+ */
+static ngx_int_t
+ngx_http_sticky_learn_lookup(ngx_http_request_t *r, ngx_http_sticky_srv_conf_t *conf)
+{
+    ngx_http_sticky_learn_t       *learn = conf->learn;
+    ngx_http_variable_value_t     *vv;
+    ngx_http_sticky_learn_node_t  *ln;
+    ngx_int_t                      n = NGX_DECLINED;
+    time_t                         now;
+    uint32_t                       hash;
+
+    vv = ngx_http_get_flushed_variable( r, learn->lookup );
+
+    if( NULL == vv || vv->not_found || 0 == vv->len ) {
+        return NGX_DECLINED;
+    }
+
+    hash = ngx_crc32_short( vv->data, vv->len );
+    now = ngx_time();
+
+    ngx_shmtx_lock( &learn->shpool->mutex );
+
+    ln = ngx_http_sticky_learn_find( learn, hash, vv->data, vv->len );
+
+    if( ln && now - ln->last <= learn->timeout
+            && ln->peer < conf->number + conf->backup_number && conf->peers[ln->peer].id == ln->peer_id ) {
+
+        n = ln->peer;
+
+        /* used again, move it away from the eviction */
+        ln->last = now;
+        ngx_queue_remove( &ln->queue );
+        ngx_queue_insert_head( &learn->sh->queue, &ln->queue );
+    }
+
+    ngx_shmtx_unlock( &learn->shpool->mutex );
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                  "[sticky/learn_lookup] session \"%v\" peer %i", vv, n);
+
+    return n;
+}
+
+/*
+ * bind the session created by the response to the peer which served it
+ */
+static void
+ngx_http_sticky_learn_store(ngx_http_request_t *r, ngx_http_sticky_srv_conf_t *conf, ngx_uint_t peer)
+{
+    ngx_http_sticky_learn_t       *learn = conf->learn;
+    ngx_http_variable_value_t     *vv;
+    ngx_http_sticky_learn_node_t  *ln;
+    ngx_rbtree_node_t             *node;
+    size_t                         size;
+    time_t                         now;
+    uint32_t                       hash;
+
+    vv = ngx_http_get_flushed_variable( r, learn->create );
+
+    if( NULL == vv || vv->not_found || 0 == vv->len || vv->len > 65535 ) {
+        return;
+    }
+
+    hash = ngx_crc32_short( vv->data, vv->len );
+    now = ngx_time();
+
+    ngx_shmtx_lock( &learn->shpool->mutex );
+
+    ngx_http_sticky_learn_expire( learn, now, 1 );
+
+    ln = ngx_http_sticky_learn_find( learn, hash, vv->data, vv->len );
+
+    if( ln ) {
+        ngx_queue_remove( &ln->queue );
+
+    } else {
+        size = offsetof(ngx_rbtree_node_t, color)
+               + offsetof(ngx_http_sticky_learn_node_t, data)
+               + vv->len;
+
+        node = ngx_slab_alloc_locked( learn->shpool, size );
+
+        if( NULL == node ) {
+            /* the zone is full, forget the least recently used session */
+            ngx_http_sticky_learn_expire( learn, now, 0 );
+
+            node = ngx_slab_alloc_locked( learn->shpool, size );
+
+            if( NULL == node ) {
+                ngx_shmtx_unlock( &learn->shpool->mutex );
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                              "[sticky/learn_store] could not allocate session%s", learn->shpool->log_ctx);
+                return;
+            }
+        }
+
+        node->key = hash;
+
+        ln = (ngx_http_sticky_learn_node_t *) &node->color;
+        ln->len = (u_short) vv->len;
+        ngx_memcpy( ln->data, vv->data, vv->len );
+
+        ngx_rbtree_insert( &learn->sh->rbtree, node );
+    }
+
+    ln->last = now;
+    ln->peer = peer;
+    ln->peer_id = conf->peers[peer].id;
+
+    ngx_queue_insert_head( &learn->sh->queue, &ln->queue );
+
+    ngx_shmtx_unlock( &learn->shpool->mutex );
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                  "[sticky/learn_store] session \"%v\" bound to peer %ui", vv, peer);
+}
+
+/*
+ * stats: the counters of an upstream live in a zone named after it,
+ * which is added once the number of its peers is known
+ */
+static ngx_str_t  ngx_http_sticky_stat_names[] = {
+    ngx_string("route"),
+    ngx_string("matched"),
+    ngx_string("unmatched"),
+    ngx_string("down"),
+    ngx_string("busy"),
+    ngx_string("cookie"),
+    ngx_string("fallback_rr"),
+    ngx_string("fallback_lc"),
+    ngx_string("fallback_p2c"),
+    ngx_string("fallback_chash"),
+    ngx_string("fallback_ewma"),
+    ngx_string("fallback_random"),
+    ngx_string("failover"),
+    ngx_string("spill"),
+    ngx_string("queued"),
+    ngx_string("queue_full"),
+    ngx_string("queue_timeout"),
+    ngx_string("queue_wait_ms"),
+};
+
+/* the prometheus "le" of each bucket, in seconds */
+static ngx_str_t  ngx_http_sticky_hist_le[] = {
+    ngx_string("0.005"), ngx_string("0.01"), ngx_string("0.025"), ngx_string("0.05"),
+    ngx_string("0.1"), ngx_string("0.25"), ngx_string("0.5"), ngx_string("1"),
+    ngx_string("2.5"), ngx_string("5"), ngx_string("10"), ngx_string("+Inf"),
+};
+
+static ngx_str_t  ngx_http_sticky_hist_names[] = {
+    ngx_string("sticky"),
+    ngx_string("fallback"),
+};
+
+/* the longest line a histogram sample can take, without its labels */
+#define NGX_HTTP_STICKY_HIST_LINE_LEN                                                          \
+    (sizeof("nginx_sticky_peer_response_seconds_bucket{upstream=\"\",server=\"\",assignment=\"fallback\",le=\"+Inf\"} \n") \
+     + NGX_ATOMIC_T_LEN + 4)
+
+#define NGX_HTTP_STICKY_HIST_LEN(labels)                                                        \
+    (2 * (NGX_HTTP_STICKY_HIST_BUCKETS + 3) * (NGX_HTTP_STICKY_HIST_LINE_LEN + (labels)))
+
+static ngx_int_t
+ngx_http_sticky_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_sticky_srv_conf_t  *oconf = data;
+    ngx_http_sticky_srv_conf_t  *conf = shm_zone->data;
+    ngx_slab_pool_t             *shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /*
+     * reload: the workers of the old cycle still count in the block, it's
+     * never freed. Kept if it has room for the peers, else left to them.
+     * A zone of another size is a new zone, the old block isn't in it
+     */
+    if( oconf && oconf->stats
+        && (u_char *) oconf->stats >= shm_zone->shm.addr
+        && (u_char *) oconf->stats < shm_zone->shm.addr + shm_zone->shm.size
+        && oconf->stats->capacity >= conf->number )
+    {
+        conf->stats = oconf->stats;
+
+        /* other servers at the same positions, their counters start over */
+        if( conf->stats->number != conf->number ) {
+            ngx_memzero( conf->stats->peer, conf->stats->capacity * sizeof(ngx_http_sticky_counters_t) );
+            conf->stats->number = conf->number;
+        }
+
+        return NGX_OK;
+    }
+
+    if( shm_zone->shm.exists ) {
+        conf->stats = shpool->data;
+        return NGX_OK;
+    }
+
+    conf->stats = ngx_slab_calloc( shpool, offsetof(ngx_http_sticky_stats_t, peer)
+                                           + NGX_HTTP_STICKY_STATS_ROOM(conf->number)
+                                             * sizeof(ngx_http_sticky_counters_t) );
+
+    if( NULL == conf->stats ) {
+        return NGX_ERROR;
+    }
+
+    conf->stats->number = conf->number;
+    conf->stats->capacity = NGX_HTTP_STICKY_STATS_ROOM(conf->number);
+    shpool->data = conf->stats;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_sticky_stats_add(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us, ngx_http_sticky_srv_conf_t *conf)
+{
+    ngx_str_t  name;
+    size_t     size;
+
+    name.len = sizeof("sticky_stats_") - 1 + us->host.len;
+    name.data = ngx_pnalloc( cf->pool, name.len );
+
+    if( NULL == name.data ) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf( name.data, "sticky_stats_%V", &us->host );
+
+    size = 8 * ngx_pagesize
+           + ngx_align(offsetof(ngx_http_sticky_stats_t, peer)
+                       + NGX_HTTP_STICKY_STATS_ROOM(conf->number) * sizeof(ngx_http_sticky_counters_t), ngx_pagesize);
+
+    conf->stats_zone = ngx_shared_memory_add( cf, &name, size, &ngx_http_sticky_lc_module );
+
+    if( NULL == conf->stats_zone ) {
+        return NGX_ERROR;
+    }
+
+    conf->stats_zone->init = ngx_http_sticky_stats_init_zone;
+    conf->stats_zone->data = conf;
+
+    return NGX_OK;
+}
+
+/*
+ * "latency":{"sticky":{"buckets":[...],"sum":ms,"failed":n},"fallback":{...}}
+ */
+static u_char *
+ngx_http_sticky_status_json_latency(u_char *p, ngx_http_sticky_counters_t *c)
+{
+    ngx_http_sticky_histogram_t  *h;
+    ngx_uint_t                    a, b;
+
+    p = ngx_cpymem( p, "\"latency\":{", sizeof("\"latency\":{") - 1 );
+
+    for( a = 0; a < 2; a++ ) {
+        h = &c->latency[a];
+
+        p = ngx_sprintf( p, "%s\"%V\":{\"buckets\":[", a ? "," : "", &ngx_http_sticky_hist_names[a] );
+
+        for( b = 0; b < NGX_HTTP_STICKY_HIST_BUCKETS; b++ ) {
+            p = ngx_sprintf( p, "%s%uA", b ? "," : "", h->bucket[b] );
+        }
+
+        p = ngx_sprintf( p, "],\"sum\":%uA,\"failed\":%uA}", h->sum, h->failed );
+    }
+
+    *p++ = '}';
+
+    return p;
+}
+
+/*
+ * the samples of one response time histogram, cumulative as prometheus wants them,
+ * server is NULL for the upstream as a whole
+ */
+static u_char *
+ngx_http_sticky_status_prometheus_latency(u_char *p, ngx_str_t *upstream, ngx_str_t *server,
+    ngx_http_sticky_counters_t *c)
+{
+    ngx_http_sticky_histogram_t  *h;
+    ngx_atomic_uint_t             count;
+    ngx_uint_t                    a, b;
+    u_char                       *labels, *last;
+
+#if( NGX_SUPPRESS_WARN )
+    labels = NULL;
+    last = NULL;
+#endif
+
+    for( a = 0; a < 2; a++ ) {
+        h = &c->latency[a];
+        count = 0;
+
+        for( b = 0; b < NGX_HTTP_STICKY_HIST_BUCKETS; b++ ) {
+            count += h->bucket[b];
+
+            p = ngx_sprintf( p, "nginx_sticky_%sresponse_seconds_bucket{", server ? "peer_" : "" );
+
+            /* the labels are written once in the output, then copied on the next lines */
+            if( 0 == b ) {
+                labels = p;
+
+                if( server ) {
+                    p = ngx_sprintf( p, "upstream=\"%V\",server=\"%V\",assignment=\"%V\"",
+                                     upstream, server, &ngx_http_sticky_hist_names[a] );
+                } else {
+                    p = ngx_sprintf( p, "upstream=\"%V\",assignment=\"%V\"",
+                                     upstream, &ngx_http_sticky_hist_names[a] );
+                }
+
+                last = p;
+
+            } else {
+                p = ngx_cpymem( p, labels, last - labels );
+            }
+
+            p = ngx_sprintf( p, ",le=\"%V\"} %uA\n", &ngx_http_sticky_hist_le[b], count );
+        }
+
+        p = ngx_sprintf( p, "nginx_sticky_%sresponse_seconds_sum{", server ? "peer_" : "" );
+        p = ngx_cpymem( p, labels, last - labels );
+        p = ngx_sprintf( p, "} %uA.%03uA\n", h->sum / 1000, h->sum % 1000 );
+
+        p = ngx_sprintf( p, "nginx_sticky_%sresponse_seconds_count{", server ? "peer_" : "" );
+        p = ngx_cpymem( p, labels, last - labels );
+        p = ngx_sprintf( p, "} %uA\n", count );
+
+        p = ngx_sprintf( p, "nginx_sticky_%sresponse_failed_total{", server ? "peer_" : "" );
+        p = ngx_cpymem( p, labels, last - labels );
+        p = ngx_sprintf( p, "} %uA\n", h->failed );
+    }
+
+    return p;
+}
+
+/*
+ * sticky_status: the counters of every upstream with "stats",
+ * in json or in the prometheus text format
+ */
+static ngx_int_t
+ngx_http_sticky_status_handler(ngx_http_request_t *r)
+{
+    ngx_http_sticky_loc_conf_t      *slcf;
+    ngx_http_upstream_main_conf_t   *umcf;
+    ngx_http_upstream_srv_conf_t   **uscfp;
+    ngx_http_sticky_srv_conf_t      *conf;
+    ngx_http_sticky_counters_t      *c;
+    ngx_buf_t                       *b;
+    ngx_chain_t                      out;
+    ngx_int_t                        rc;
+    ngx_uint_t                       i, j, k, n, first;
+    size_t                           len;
+
+    if( !(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)) ) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if( NGX_OK != rc ) {
+        return rc;
+    }
+
+    slcf = ngx_http_get_module_loc_conf( r, ngx_http_sticky_lc_module );
+    umcf = ngx_http_get_module_main_conf( r, ngx_http_upstream_module );
+    uscfp = umcf->upstreams.elts;
+
+    /* a line for each counter of each upstream and of each peer is the worst case */
+    len = sizeof("{\"upstreams\":{}}\n")
+          + 2 * NGX_HTTP_STICKY_STAT_N * sizeof("# TYPE nginx_sticky_peer_fallback_chash_total counter\n")
+          + 4 * sizeof("# TYPE nginx_sticky_peer_response_seconds histogram\n")
+          + 2 * sizeof("# TYPE nginx_sticky_peer_queue_depth gauge\n");
+
+    for( i = 0; i < umcf->upstreams.nelts; i++ ) {
+        conf = uscfp[i]->srv_conf ? ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_http_sticky_lc_module) : NULL;
+
+        if( NULL == conf || NULL == conf->stats ) {
+            continue;
+        }
+
+        n = ngx_min( conf->stats->number, conf->number );
+
+        len += (NGX_HTTP_STICKY_STAT_N + 1)
+               * (sizeof("nginx_sticky_fallback_chash_total{upstream=\"\"} \n") + uscfp[i]->host.len + NGX_ATOMIC_T_LEN)
+               + NGX_HTTP_STICKY_HIST_LEN(uscfp[i]->host.len)
+               + sizeof("\"\":{\"peers\":[]},") + uscfp[i]->host.len;
+
+        for( j = 0; j < n; j++ ) {
+            len += (NGX_HTTP_STICKY_STAT_N + 1)
+                   * (sizeof("nginx_sticky_peer_fallback_chash_total{upstream=\"\",server=\"\"} \n")
+                      + uscfp[i]->host.len + conf->peers[j].name.len + NGX_ATOMIC_T_LEN)
+                   + NGX_HTTP_STICKY_HIST_LEN(uscfp[i]->host.len + conf->peers[j].name.len)
+                   + sizeof("{\"server\":\"\"},") + conf->peers[j].name.len;
+        }
+    }
+
+    b = ngx_create_temp_buf( r->pool, len );
+
+    if( NULL == b ) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if( NGX_HTTP_STICKY_STATUS_PROMETHEUS == slcf->status_format ) {
+
+        /* the samples of a metric have to follow each other */
+        for( k = 0; k < NGX_HTTP_STICKY_STAT_N; k++ ) {
+            b->last = ngx_sprintf( b->last, "# TYPE nginx_sticky_%V_total counter\n", &ngx_http_sticky_stat_names[k] );
+
+            for( i = 0; i < umcf->upstreams.nelts; i++ ) {
+                conf = uscfp[i]->srv_conf ? ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_http_sticky_lc_module) : NULL;
+
+                if( NULL == conf || NULL == conf->stats ) {
+                    continue;
+                }
+
+                b->last = ngx_sprintf( b->last, "nginx_sticky_%V_total{upstream=\"%V\"} %uA\n",
+                                       &ngx_http_sticky_stat_names[k], &uscfp[i]->host,
+                                       conf->stats->upstream.counter[k] );
+            }
+        }
+
+        for( k = 0; k < NGX_HTTP_STICKY_STAT_N; k++ ) {
+            b->last = ngx_sprintf( b->last, "# TYPE nginx_sticky_peer_%V_total counter\n", &ngx_http_sticky_stat_names[k] );
+
+            for( i = 0; i < umcf->upstreams.nelts; i++ ) {
+                conf = uscfp[i]->srv_conf ? ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_http_sticky_lc_module) : NULL;
+
+                if( NULL == conf || NULL == conf->stats ) {
+                    continue;
+                }
+
+                n = ngx_min( conf->stats->number, conf->number );
+
+                for( j = 0; j < n; j++ ) {
+                    b->last = ngx_sprintf( b->last, "nginx_sticky_peer_%V_total{upstream=\"%V\",server=\"%V\"} %uA\n",
+                                           &ngx_http_sticky_stat_names[k], &uscfp[i]->host, &conf->peers[j].name,
+                                           conf->stats->peer[j].counter[k] );
+                }
+            }
+        }
+
+        /* requests waiting in sticky_queue now */
+        for( k = 0; k < 2; k++ ) {
+            b->last = ngx_sprintf( b->last, "# TYPE nginx_sticky_%squeue_depth gauge\n", k ? "peer_" : "" );
+
+            for( i = 0; i < umcf->upstreams.nelts; i++ ) {
+                conf = uscfp[i]->srv_conf ? ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_http_sticky_lc_module) : NULL;
+
+                if( NULL == conf || NULL == conf->stats ) {
+                    continue;
+                }
+
+                if( 0 == k ) {
+                    b->last = ngx_sprintf( b->last, "nginx_sticky_queue_depth{upstream=\"%V\"} %uA\n",
+                                           &uscfp[i]->host, conf->stats->upstream.queue_depth );
+                    continue;
+                }
+
+                n = ngx_min( conf->stats->number, conf->number );
+
+                for( j = 0; j < n; j++ ) {
+                    b->last = ngx_sprintf( b->last, "nginx_sticky_peer_queue_depth{upstream=\"%V\",server=\"%V\"} %uA\n",
+                                           &uscfp[i]->host, &conf->peers[j].name, conf->stats->peer[j].queue_depth );
+                }
+            }
+        }
+
+        /* response times, for the upstreams then for their peers */
+        for( k = 0; k < 2; k++ ) {
+            b->last = ngx_sprintf( b->last, "# TYPE nginx_sticky_%sresponse_seconds histogram\n"
+                                            "# TYPE nginx_sticky_%sresponse_failed_total counter\n",
+                                   k ? "peer_" : "", k ? "peer_" : "" );
+
+            for( i = 0; i < umcf->upstreams.nelts; i++ ) {
+                conf = uscfp[i]->srv_conf ? ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_http_sticky_lc_module) : NULL;
+
+                if( NULL == conf || NULL == conf->stats ) {
+                    continue;
+                }
+
+                if( 0 == k ) {
+                    b->last = ngx_http_sticky_status_prometheus_latency( b->last, &uscfp[i]->host, NULL,
+                                                                         &conf->stats->upstream );
+                    continue;
+                }
+
+                n = ngx_min( conf->stats->number, conf->number );
+
+                for( j = 0; j < n; j++ ) {
+                    b->last = ngx_http_sticky_status_prometheus_latency( b->last, &uscfp[i]->host, &conf->peers[j].name,
+                                                                         &conf->stats->peer[j] );
+                }
+            }
+        }
+
+        ngx_str_set( &r->headers_out.content_type, "text/plain; version=0.0.4" );
+
+    } else {
+
+        b->last = ngx_cpymem( b->last, "{\"upstreams\":{", sizeof("{\"upstreams\":{") - 1 );
+        first = 1;
+
+        for( i = 0; i < umcf->upstreams.nelts; i++ ) {
+            conf = uscfp[i]->srv_conf ? ngx_http_conf_upstream_srv_conf(uscfp[i], ngx_http_sticky_lc_module) : NULL;
+
+            if( NULL == conf || NULL == conf->stats ) {
+                continue;
+            }
+
+            b->last = ngx_sprintf( b->last, "%s\"%V\":{", first ? "" : ",", &uscfp[i]->host );
+            first = 0;
+
+            c = &conf->stats->upstream;
+
+            for( k = 0; k < NGX_HTTP_STICKY_STAT_N; k++ ) {
+                b->last = ngx_sprintf( b->last, "\"%V\":%uA,", &ngx_http_sticky_stat_names[k], c->counter[k] );
+            }
+
+            b->last = ngx_sprintf( b->last, "\"queue_depth\":%uA,", c->queue_depth );
+
+            b->last = ngx_http_sticky_status_json_latency( b->last, c );
+            b->last = ngx_cpymem( b->last, ",\"peers\":[", sizeof(",\"peers\":[") - 1 );
+
+            n = ngx_min( conf->stats->number, conf->number );
+
+            for( j = 0; j < n; j++ ) {
+                c = &conf->stats->peer[j];
+
+                b->last = ngx_sprintf( b->last, "%s{\"server\":\"%V\"", j ? "," : "", &conf->peers[j].name );
+
+                for( k = 0; k < NGX_HTTP_STICKY_STAT_N; k++ ) {
+                    b->last = ngx_sprintf( b->last, ",\"%V\":%uA", &ngx_http_sticky_stat_names[k], c->counter[k] );
+                }
+
+                b->last = ngx_sprintf( b->last, ",\"queue_depth\":%uA", c->queue_depth );
+
+                *b->last++ = ',';
+                b->last = ngx_http_sticky_status_json_latency( b->last, c );
+                *b->last++ = '}';
+            }
+
+            b->last = ngx_cpymem( b->last, "]}", 2 );
+        }
+
+        b->last = ngx_cpymem( b->last, "}}\n", 3 );
+
+        ngx_str_set( &r->headers_out.content_type, "application/json" );
+    }
+
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if( NGX_ERROR == rc || rc > NGX_OK || r->header_only ) {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/*
+ * the average response time of a peer, decayed while nobody updates it
+ * so that a peer which was slow gets tried again. 0 when it has no
+ * history, or when it has faded away
+ */
+static ngx_inline ngx_msec_t
+ngx_http_sticky_ewma(ngx_http_sticky_peer_t *sp, ngx_msec_t now)
+{
+    ngx_msec_t  periods = (now - sp->ewma_stamp) / NGX_HTTP_STICKY_EWMA_DECAY;
+
+    if( periods >= 16 ) {
+        return 0;
+    }
+
+    return sp->ewma >> periods;
+}
+
+static void
+ngx_http_sticky_ewma_update(ngx_http_sticky_peer_data_t *iphp, ngx_uint_t k, ngx_uint_t failed)
+{
+    ngx_http_sticky_peer_t     *sp = &iphp->sticky_conf->peers[k];
+    ngx_msec_t                  now = ngx_current_msec;
+    ngx_msec_t                  sample, ewma;
+#if defined(nginx_version) && nginx_version >= 1007010
+    ngx_http_upstream_t        *u = iphp->request->upstream;
+#endif
+
+    sample = now - iphp->start;
+
+#if defined(nginx_version) && nginx_version >= 1007010
+    /* the time to the response header doesn't depend on the size of the body */
+    if( !failed && u && u->state && u->state->header_time != (ngx_msec_t) -1 && u->state->header_time <= sample ) {
+        sample = u->state->header_time;
+    }
+#endif
+
+    if( failed ) {
+        sample = ngx_max( sample, NGX_HTTP_STICKY_EWMA_PENALTY );
+    }
+
+    /* 0 stands for no history */
+    sample = ngx_max( sample << NGX_HTTP_STICKY_EWMA_SHIFT, 1 );
+
+    ewma = ngx_http_sticky_ewma( sp, now );
+
+    /* the first sample is the average, it doesn't climb from nothing */
+    if( 0 == ewma ) {
+        ewma = sample;
+
+    } else if( sample > ewma ) {
+        ewma += (sample - ewma) >> NGX_HTTP_STICKY_EWMA_WEIGHT;
+    } else {
+        ewma -= (ewma - sample) >> NGX_HTTP_STICKY_EWMA_WEIGHT;
+    }
+
+    sp->ewma = ewma;
+    sp->ewma_stamp = now;
+}
+
+/*
+ * latency aware: the peer with the lowest ewma * (conns + 1) / weight,
+ * so a slow peer gets fewer new sessions even with few connections.
+ * A peer with no history, new, recovered or idle for long, counts as
+ * the average of the others instead of the fastest of them all
+ */
+static ngx_int_t
+ngx_http_upstream_get_ewma_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_sticky_peer_data_t  *iphp = data;
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peers_t *peers = iphp->rrp.peers;
+    ngx_http_upstream_rr_peer_t  *peer, *best;
+
+    time_t                        now = ngx_time();
+    ngx_msec_t                    msec = ngx_current_msec;
+    ngx_uint_t                    i, j, p, start, known;
+    ngx_msec_t                    ewma, average;
+    uint64_t                      score, best_score;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            "[sticky/get_ewma_peer] get ewma peer, try: %ui", pc->tries);
+
+    if( peers->single ) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &iphp->rrp);
+    }
+
+    /* the averages are kept for the primary peers only, least_conn knows when there are none */
+    if( 0 == conf->number || peers->peer != conf->peers[0].rr_peer ) {
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    /* equal scores go to the first peer after a rotating start */
+    start = conf->lc_seq++ % conf->number;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    /* what a peer with no history is worth, all equal when none has one */
+    average = 0;
+    known = 0;
+
+    for( i = 0; i < conf->number; i++ ) {
+        ewma = ngx_http_sticky_ewma( &conf->peers[i], msec );
+
+        if( ewma ) {
+            average += ewma;
+            known++;
+        }
+    }
+
+    average = known ? ngx_max( average / known, 1 ) : 1;
+
+again:
+
+    best = NULL;
+    best_score = 0;
+    p = 0;
+
+    for( j = 0; j < conf->number; j++ ) {
+        i = (start + j) % conf->number;
+        peer = conf->peers[i].rr_peer;
+
+        if( !ngx_http_sticky_peer_usable(&iphp->rrp, peer, i, now) || ngx_http_sticky_check_down(conf, i) ) {
+            continue;
+        }
+
+        ewma = ngx_http_sticky_ewma( &conf->peers[i], msec );
+
+        /* score / weight, compared cross multiplied */
+        score = (uint64_t) (ewma ? ewma : average) * (peer->conns + 1);
+
+        if( NULL == best || score * best->weight < best_score * peer->weight ) {
+            best = peer;
+            best_score = score;
+            p = i;
+        }
+    }
+
+    /* no primary peer left, least conn switches to the backup servers */
+    if( NULL == best ) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "[sticky/get_ewma_peer] no usable peer");
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
+
+    ngx_http_upstream_rr_peer_lock(peers, best);
+
+#if defined(nginx_version) && nginx_version >= 1011005
+    /* another worker took the last connection meanwhile */
+    if( best->max_conns && best->conns >= best->max_conns ) {
+        ngx_http_upstream_rr_peer_unlock(peers, best);
+        iphp->rrp.tried[p / (8 * sizeof(uintptr_t))] |= (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+        goto again;
+    }
+#endif
+
+    ngx_http_sticky_use_peer( pc, &iphp->rrp, best, p, now );
+
+    ngx_http_upstream_rr_peer_unlock(peers, best);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_ewma_peer] picked peer %ui", p);
+
+    return NGX_OK;
+}
+
+/*
+ * build the alias table of the primary peers (Vose): each column holds
+ * a peer and the peer filling the rest of it, so a draw is one random
+ * column and one random threshold whatever the number of peers.
+ * integers only, the columns are worth the total weight
+ */
+static ngx_int_t
+ngx_http_sticky_alias_init(ngx_pool_t *pool, ngx_http_sticky_srv_conf_t *conf)
+{
+    ngx_uint_t  *work, i, s, l, nsmall, nlarge;
+    uint64_t    *scaled, total;
+
+    conf->alias = NULL;
+    conf->alias_total = 0;
+
+    if( 0 == conf->number ) {
+        return NGX_OK;
+    }
+
+    conf->alias = ngx_palloc( pool, sizeof(ngx_http_sticky_alias_t) * conf->number );
+    scaled = ngx_palloc( pool, sizeof(uint64_t) * conf->number );
+
+    /* small columns stack up from the start, large ones from the end */
+    work = ngx_palloc( pool, sizeof(ngx_uint_t) * conf->number );
+
+    if( NULL == conf->alias || NULL == scaled || NULL == work ) {
+        return NGX_ERROR;
+    }
+
+    total = 0;
+
+    for( i = 0; i < conf->number; i++ ) {
+        total += conf->peers[i].rr_peer->weight;
+    }
+
+    nsmall = 0;
+    nlarge = 0;
+
+    for( i = 0; i < conf->number; i++ ) {
+        scaled[i] = (uint64_t) conf->peers[i].rr_peer->weight * conf->number;
+
+        if( scaled[i] < total ) {
+            work[nsmall++] = i;
+        } else {
+            work[conf->number - ++nlarge] = i;
+        }
+    }
+
+    while( nsmall && nlarge ) {
+        s = work[--nsmall];
+        l = work[conf->number - nlarge--];
+
+        conf->alias[s].prob = scaled[s];
+        conf->alias[s].alias = l;
+
+        /* the large peer fills the rest of the small one's column */
+        scaled[l] -= total - scaled[s];
+
+        if( scaled[l] < total ) {
+            work[nsmall++] = l;
+        } else {
+            work[conf->number - ++nlarge] = l;
+        }
+    }
+
+    /* what's left is worth a whole column */
+    while( nlarge ) {
+        l = work[conf->number - nlarge--];
+        conf->alias[l].prob = total;
+        conf->alias[l].alias = l;
+    }
+
+    while( nsmall ) {
+        s = work[--nsmall];
+        conf->alias[s].prob = total;
+        conf->alias[s].alias = s;
+    }
+
+    conf->alias_total = total;
+
+    return NGX_OK;
+}
+
+/*
+ * weighted random in O(1): a peer is drawn out of the alias table, then
+ * kept with a probability of effective_weight / weight, so peers which
+ * failed lately are drawn less without rebuilding the table.
+ * tried, down, failed and full peers are drawn again
+ */
+static ngx_int_t
+ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_sticky_peer_data_t  *iphp = data;
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peers_t *peers = iphp->rrp.peers;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    time_t                        now = ngx_time();
+    ngx_uint_t                    i, tries;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            "[sticky/get_random_peer] get random peer, try: %ui", pc->tries);
+
+    if( peers->single ) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &iphp->rrp);
+    }
+
+    /* the table only knows the primary peers, if any resolved */
+    if( 0 == conf->number || peers->peer != conf->peers[0].rr_peer || NULL == conf->alias ) {
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for( tries = 0; tries < NGX_HTTP_STICKY_RANDOM_TRIES; tries++ ) {
+        i = ngx_random() % conf->number;
+
+        if( (((uint64_t) ngx_random() * conf->alias_total) >> 31) >= conf->alias[i].prob ) {
+            i = conf->alias[i].alias;
+        }
+
+        peer = conf->peers[i].rr_peer;
+
+        if( !ngx_http_sticky_peer_usable(&iphp->rrp, peer, i, now) || ngx_http_sticky_check_down(conf, i) ) {
+            continue;
+        }
+
+        if( peer->effective_weight < peer->weight
+                && (ngx_int_t) (ngx_random() % peer->weight) >= peer->effective_weight ) {
+            continue;
+        }
+
+        ngx_http_upstream_rr_peer_lock(peers, peer);
+
+#if defined(nginx_version) && nginx_version >= 1011005
+        /* another worker took the last connection meanwhile */
+        if( peer->max_conns && peer->conns >= peer->max_conns ) {
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
+            continue;
+        }
+#endif
+
+        ngx_http_sticky_use_peer( pc, &iphp->rrp, peer, i, now );
+
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_random_peer] picked peer %ui", i);
+
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    /* most peers are unusable, let least conn scan them all */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "[sticky/get_random_peer] no usable peer drawn, scanning");
+
+    return ngx_http_upstream_get_least_conn_peer(pc, data);
+}
+
+/*
+ * failover=hrw: the sessions of a failing peer go to the usable peer with
+ * the highest random weight for it, a hash of both peer ids. Every worker
+ * picks the same one, and the next one if it fails too, whatever the
+ * order of the servers; weights are not taken into account.
+ * with max_load_factor=, peers within the bound come first
+ */
+static ngx_int_t
+ngx_http_upstream_get_hrw_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_sticky_peer_data_t  *iphp = data;
+    ngx_http_sticky_srv_conf_t   *conf = iphp->sticky_conf;
+    ngx_http_upstream_rr_peers_t *peers = iphp->rrp.peers;
+    ngx_http_upstream_rr_peer_t  *peer, *best;
+
+    time_t                        now = ngx_time();
+    ngx_uint_t                    i, p, bounded, best_bounded, conns = 0, weight = 0;
+    uint64_t                      key, score, best_score;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+            "[sticky/get_hrw_peer] get hrw peer, try: %ui", pc->tries);
+
+    if( peers->single ) {
+        return ngx_http_upstream_get_round_robin_peer(pc, &iphp->rrp);
+    }
 
-        for( i = 0; i < iphp->rrp.peers->number; i++ ) {
+    /* the failover is among the primary peers, if any resolved */
+    if( 0 == conf->number || peers->peer != conf->peers[0].rr_peer ) {
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
 
-            /* check sockaddr and socklen */
-            if( iphp->rrp.peers->peer[i].sockaddr == pc->sockaddr
-                    && iphp->rrp.peers->peer[i].socklen == pc->socklen ) {
+    pc->cached = 0;
+    pc->connection = NULL;
 
-                /* when enabled hash, write digest str to cookie */
-                if( conf->hash || conf->hmac || conf->text ) {
-                    ngx_http_sticky_misc_set_cookie(iphp->request, &conf->cookie_name, &conf->peers[i].digest,
-                                                    &conf->cookie_domain, &conf->cookie_path, conf->cookie_expires,
-                                                    conf->cookie_secure, conf->cookie_httponly);
-                    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                                  "[sticky/get_sticky_peer_lc]set cookie \"%V\" value=\"%V\" index=%ui",
-                                  &conf->cookie_name, &conf->peers[i].digest, i);
-                } else { /* when disabled hash , write i to cookie */
-                    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                            "[sticky/get_sticky_peer_lc] cookie disabled, write %ui to cookie", i);
-                    ngx_str_t route;
-                    ngx_uint_t tmp = i;
-                    route.len = 0;
+    key = (uint64_t) conf->peers[iphp->route_peer].id << 32;
 
-                    do {
-                        route.len++;
-                    } while( tmp /= 10 );
+    ngx_http_upstream_rr_peers_rlock(peers);
 
-                    route.data = ngx_pcalloc( iphp->request->pool, sizeof(u_char) * (route.len + 1) );
+again:
 
-                    if( NULL == route.data ) {
-                        break;
-                    }
+    if( conf->max_load_factor ) {
+        ngx_http_sticky_load( conf, &conns, &weight );
+    }
 
-                    ngx_snprintf( route.data, route.len, "%d", i );
-                    route.len = ngx_strlen(route.data);
-                    ngx_http_sticky_misc_set_cookie(iphp->request, &conf->cookie_name, &route, &conf->cookie_domain,
-                            &conf->cookie_path, conf->cookie_expires, conf->cookie_secure, conf->cookie_httponly);
-                    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                                  "[sticky/get_sticky_peer_lc] set cookie \"%V\" value=\"%V\" index=%ui",
-                                  &conf->cookie_name, &tmp, i);
-                }
+    best = NULL;
+    best_score = 0;
+    best_bounded = 0;
+    p = 0;
 
-                break; /* found and hopefully the cookie have been set */
-            }
+    for( i = 0; i < conf->number; i++ ) {
+        peer = conf->peers[i].rr_peer;
+
+        if( !ngx_http_sticky_peer_usable(&iphp->rrp, peer, i, now) || ngx_http_sticky_check_down(conf, i) ) {
+            continue;
+        }
+
+        /* splitmix64 finalizer */
+        score = key | conf->peers[i].id;
+        score = (score ^ (score >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        score = (score ^ (score >> 27)) * 0x94d049bb133111ebULL;
+        score ^= score >> 31;
+
+        bounded = !conf->max_load_factor || !ngx_http_sticky_overloaded(conf, i, conns, weight);
+
+        if( NULL == best || bounded > best_bounded || (bounded == best_bounded && score > best_score) ) {
+            best = peer;
+            best_score = score;
+            best_bounded = bounded;
+            p = i;
         }
     }
 
-    /* reset the selection in order to bypass the sticky module
-     * when the upstream module will try another peers if necessary */
-    iphp->selected_peer = -1;
+    /* no primary peer left, least conn switches to the backup servers */
+    if( NULL == best ) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "[sticky/get_hrw_peer] no usable peer");
+        return ngx_http_upstream_get_least_conn_peer(pc, data);
+    }
+
+    ngx_http_upstream_rr_peer_lock(peers, best);
+
+#if defined(nginx_version) && nginx_version >= 1011005
+    /* another worker took the last connection meanwhile */
+    if( best->max_conns && best->conns >= best->max_conns ) {
+        ngx_http_upstream_rr_peer_unlock(peers, best);
+        iphp->rrp.tried[p / (8 * sizeof(uintptr_t))] |= (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+        goto again;
+    }
+#endif
+
+    ngx_http_sticky_use_peer( pc, &iphp->rrp, best, p, now );
+
+    ngx_http_upstream_rr_peer_unlock(peers, best);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_hrw_peer] picked peer %ui", p);
 
     return NGX_OK;
 }
+
+/*
+ * sticky_queue: a request whose peer is full (max_conns), or failed with
+ * no_fallback, waits for a connection to it to be released in this worker,
+ * or for the timeout, the way limit_req delays requests. It then goes on
+ * to the upstream module, which picks its peer as usual
+ */
+
+/*
+ * take the request out of the waiting list of its peer
+ */
+static void
+ngx_http_sticky_queue_leave(ngx_http_sticky_ctx_t *ctx)
+{
+    ngx_http_sticky_srv_conf_t  *conf = ctx->queue_conf;
+
+    ngx_queue_remove( &ctx->queue );
+    ctx->waiting = 0;
+
+    conf->peers[ctx->queue_peer].nwaiting--;
+    conf->waiting--;
+
+    if( conf->stats ) {
+        (void) ngx_atomic_fetch_add( &conf->stats->upstream.queue_depth, -1 );
+
+        if( (ngx_uint_t) ctx->queue_peer < conf->stats->number ) {
+            (void) ngx_atomic_fetch_add( &conf->stats->peer[ctx->queue_peer].queue_depth, -1 );
+        }
+    }
+}
+
+/*
+ * the request stops waiting, for good
+ */
+static void
+ngx_http_sticky_queue_done(ngx_http_sticky_ctx_t *ctx, ngx_uint_t stat)
+{
+    ngx_http_sticky_srv_conf_t  *conf;
+    ngx_http_sticky_stats_t     *stats;
+    ngx_atomic_int_t             ms;
+
+    ctx->queue_done = 1;
+
+    if( !ctx->queued || NULL == ctx->queue_conf->stats ) {
+        return;
+    }
+
+    conf = ctx->queue_conf;
+    stats = conf->stats;
+
+    if( stat ) {
+        ngx_http_sticky_count( conf, stat, ctx->queue_peer );
+    }
+
+    ms = (ngx_atomic_int_t) (ngx_current_msec - ctx->queue_start);
+
+    (void) ngx_atomic_fetch_add( &stats->upstream.counter[NGX_HTTP_STICKY_STAT_QUEUE_WAIT], ms );
+
+    if( (ngx_uint_t) ctx->queue_peer < stats->number ) {
+        (void) ngx_atomic_fetch_add( &stats->peer[ctx->queue_peer].counter[NGX_HTTP_STICKY_STAT_QUEUE_WAIT], ms );
+    }
+}
+
+/*
+ * a connection was released, or the peers changed: the request runs again
+ */
+static void
+ngx_http_sticky_queue_wake(ngx_http_sticky_ctx_t *ctx)
+{
+    ngx_event_t  *wev = ctx->request->connection->write;
+
+    ngx_http_sticky_queue_leave( ctx );
+
+    if( wev->timer_set ) {
+        ngx_del_timer( wev );
+    }
+
+    wev->delayed = 0;
+    ngx_post_event( wev, &ngx_posted_events );
+}
+
+static void
+ngx_http_sticky_queue_resume(ngx_http_request_t *r)
+{
+    ngx_event_t  *wev = r->connection->write;
+
+    /* still waiting, the write event came for nothing */
+    if( wev->delayed ) {
+        if( NGX_OK != ngx_handle_write_event(wev, 0) ) {
+            ngx_http_finalize_request( r, NGX_HTTP_INTERNAL_SERVER_ERROR );
+        }
+
+        return;
+    }
+
+    if( NGX_OK != ngx_handle_read_event(r->connection->read, 0) ) {
+        ngx_http_finalize_request( r, NGX_HTTP_INTERNAL_SERVER_ERROR );
+        return;
+    }
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_core_run_phases;
+
+    ngx_http_core_run_phases( r );
+}
+
+/*
+ * the peer the route of a request leads to, NGX_DECLINED if none
+ */
 static ngx_int_t
-ngx_http_upstream_get_least_conn_peer( ngx_peer_connection_t *pc, void *data )
+ngx_http_sticky_queue_peer(ngx_http_request_t *r, ngx_http_sticky_srv_conf_t *conf)
 {
-    ngx_http_upstream_rr_peer_data_t *rrp = data;
+    ngx_str_t  route;
 
-    time_t                        now = ngx_time();
-    uintptr_t                     m = 0;
-    ngx_int_t                     total = 0, rc = NGX_ERROR;
-    ngx_uint_t                    n = 0, i;
-    ngx_uint_t                    p, many;
-    ngx_http_upstream_rr_peer_t  *peer = NULL, *best = NULL;
-    ngx_http_upstream_rr_peers_t *peers = NULL;
+    if( conf->learn ) {
+        return ngx_http_sticky_learn_lookup( r, conf );
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-            "[sticky/get_least_conn_peer] get least conn peer, try: %ui", pc->tries);
+    if( NGX_OK != ngx_http_sticky_get_route( r, conf, &route ) ) {
+        return NGX_DECLINED;
+    }
 
-    if ( rrp->peers->single ) {
-        return ngx_http_upstream_get_round_robin_peer(pc, rrp);
+    if( conf->hash || conf->hmac || conf->text ) {
+        return ngx_http_sticky_lookup( conf, &route );
     }
 
-    pc->cached = 0;
-    pc->connection = NULL;
+    return ngx_atoi( route.data, route.len );
+}
 
-    peers = rrp->peers;   /* get all peers from upstream */
+/*
+ * preaccess phase handler
+ */
+static ngx_int_t
+ngx_http_sticky_queue_handler(ngx_http_request_t *r)
+{
+    ngx_http_sticky_loc_conf_t    *slcf;
+    ngx_http_sticky_srv_conf_t    *conf;
+    ngx_http_upstream_rr_peers_t  *peers;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_sticky_ctx_t         *ctx;
+    ngx_msec_t                     waited;
+    ngx_uint_t                     busy, woken;
+    ngx_int_t                      n;
+    time_t                         now;
+
+    slcf = ngx_http_get_module_loc_conf( r, ngx_http_sticky_lc_module );
+
+    if( NULL == slcf->queue_upstream || r != r->main || NULL == slcf->queue_upstream->srv_conf ) {
+        return NGX_DECLINED;
+    }
 
-    ngx_http_upstream_rr_peers_wlock(peers);
+    ctx = ngx_http_sticky_get_ctx( r, 0 );
 
-#if( NGX_SUPPRESS_WARN )
-    many = 0;
-    p = 0;
+    if( ctx && ctx->queue_done ) {
+        return NGX_DECLINED;
+    }
+
+    /* the timer fired first */
+    if( ctx && ctx->waiting ) {
+        ngx_http_sticky_queue_leave( ctx );
+        ngx_http_sticky_queue_done( ctx, NGX_HTTP_STICKY_STAT_QUEUE_TIMEOUT );
+
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                      "[sticky/queue_handler] no connection released in time, going on");
+        return NGX_DECLINED;
+    }
+
+    conf = ngx_http_conf_upstream_srv_conf( slcf->queue_upstream, ngx_http_sticky_lc_module );
+    peers = slcf->queue_upstream->peer.data;
+
+    if( NULL == conf->peers || NULL == peers ) {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if( NGX_OK != ngx_http_sticky_zone_lock_sync( conf, peers, r->connection->log ) ) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 #endif
 
-    /* traversal all valid peer and get a best peer with weighted least conns */
-    for(peer = peers->peer, i = 0;
-            peer;
-            peer = peer->next, i++) {
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-            "[sticky/get_least_conn_peer] peer no: %ui peer conns: %ui peer weight: %ui", i,  peer->conns, peer->weight );
+    n = ngx_http_sticky_queue_peer( r, conf );
 
-        n = i / (8 * sizeof(uintptr_t));
-        m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+    /* only the primary peers are waited for */
+    if( n < 0 || n >= (ngx_int_t) conf->number ) {
+        return NGX_DECLINED;
+    }
 
-        if( rrp->tried[n] & m || peer->down ) {
-            continue;
-        }
+    peer = conf->peers[n].rr_peer;
+    now = ngx_time();
+    busy = 0;
 
-        if(peer->max_fails
-                && peer->fails >= peer->max_fails
-                && now - peer->checked <= peer->fail_timeout)
-        {
-            continue;
-        }
+    ngx_http_upstream_rr_peers_rlock(peers);
 
 #if defined(nginx_version) && nginx_version >= 1011005
-        if( peer->max_conns && peer->conns >= peer->max_conns ) {
-            continue;
-        }
+    if( peer->max_conns && peer->conns >= peer->max_conns ) {
+        busy = 1;
+    }
 #endif
 
-        /*
-         * select peer with least number of connections; if there are
-         * multiple peers with the same number of connections, select
-         * based on round-robin
-         */
-        if( NULL == best || ( peer->conns * best->weight < best->conns * peer->weight) ) {
-#if 0
-            if( NULL != best ) {
-                ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                    "[sticky/get_least_conn_peer] best conns: %ui best weight: %ui", best->conns, best->weight );
-            }
-            ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                "[sticky/get_least_conn_peer] peer conns: %ui peer weight: %ui", peer->conns, peer->weight );
-#endif
-            best = peer;
-            many = 0;
-            p = i;
-        } else if( peer->conns * best->weight == best->conns * peer->weight )
-        {
-            many = 1;
-        }
+    if( conf->no_fallback
+        && (peer->down
+            || (peer->max_fails && peer->fails >= peer->max_fails && now - peer->checked <= peer->fail_timeout)) )
+    {
+        busy = 1;
     }
 
-    if( NULL == best ) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                       "[sticky/get_least_conn_peer] no least conn peer found");
-        if( peers->next ) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
-                            "[sticky/get_least_conn_peer] get least conn peer, backup servers");
+    ngx_http_upstream_rr_peers_unlock(peers);
 
-            rrp->peers = peers->next;
-            n = ( rrp->peers->number+(8*sizeof(uintptr_t)-1) ) / (8 * sizeof(uintptr_t));
+    if( !busy ) {
+        if( ctx && ctx->queued ) {
+            ngx_http_sticky_queue_done( ctx, 0 );
+        }
 
-            for(i = 0; i < n; i++) {
-                rrp->tried[i] = 0;
-            }
+        return NGX_DECLINED;
+    }
 
-            ngx_http_upstream_rr_peers_unlock(peers);
+    waited = (ctx && ctx->queued) ? ngx_current_msec - ctx->queue_start : 0;
 
-            rc = ngx_http_get_sticky_peer(pc, rrp);
+    if( waited >= slcf->queue_timeout ) {
+        ngx_http_sticky_queue_done( ctx, NGX_HTTP_STICKY_STAT_QUEUE_TIMEOUT );
+        return NGX_DECLINED;
+    }
 
-            if( NGX_BUSY != rc ) {
-                return rc;
-            }
+    if( conf->peers[n].nwaiting >= slcf->queue_length ) {
+        ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_QUEUE_FULL, n );
 
-            ngx_http_upstream_rr_peers_wlock(peers);
+        if( ctx ) {
+            ngx_http_sticky_queue_done( ctx, 0 );
         }
 
-        ngx_http_upstream_rr_peers_unlock(peers);
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                      "[sticky/queue_handler] the queue of peer %i is full", n);
+        return NGX_DECLINED;
+    }
 
-        pc->name = peers->name;
+    if( NULL == ctx ) {
+        ctx = ngx_http_sticky_get_ctx( r, 1 );
 
-        return NGX_BUSY;
+        if( NULL == ctx ) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
-    if( many ) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_least_conn_peer] got many least conn peers");
+    woken = ctx->queued;
 
-        for(peer = best, i = p;
-                peer;
-                peer = peer->next, i++) {
-            n = i / (8 * sizeof(uintptr_t));
-            m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+    if( !ctx->queued ) {
+        ctx->queued = 1;
+        ctx->queue_start = ngx_current_msec;
 
-            if( (rrp->tried[n] & m) || peer->down) {
-                continue;
-            }
+        ngx_http_sticky_count( conf, NGX_HTTP_STICKY_STAT_QUEUED, n );
+    }
 
-            if( (peer->conns * best->weight) != (best->conns * peer->weight) ) {
-                continue;
-            }
+    ctx->queue_conf = conf;
+    ctx->queue_peer = n;
+    ctx->waiting = 1;
 
-            if(peer->max_fails
-                    && peer->fails >= peer->max_fails
-                    && now - peer->checked <= peer->fail_timeout) {
-                continue;
-            }
+    /* woken up but beaten to the connection, it keeps its turn */
+    if( woken ) {
+        ngx_queue_insert_head( &conf->peers[n].waiting, &ctx->queue );
 
-#if defined(nginx_version) && nginx_version >= 1011005
-            if( peer->max_conns && peer->conns >= peer->max_conns ) {
-                continue;
-            }
-#endif
+    } else {
+        ngx_queue_insert_tail( &conf->peers[n].waiting, &ctx->queue );
+    }
 
-            peer->current_weight += peer->effective_weight;
-            total += peer->effective_weight;
+    conf->peers[n].nwaiting++;
+    conf->waiting++;
 
-            if( peer->effective_weight < peer->weight ) {
-                peer->effective_weight ++;
-            }
+    if( conf->stats ) {
+        (void) ngx_atomic_fetch_add( &conf->stats->upstream.queue_depth, 1 );
 
-            if( peer->current_weight > best->current_weight ) {
-                best = peer;
-                p = i;
-            }
+        if( (ngx_uint_t) n < conf->stats->number ) {
+            (void) ngx_atomic_fetch_add( &conf->stats->peer[n].queue_depth, 1 );
         }
     }
 
-    best->current_weight -= total;
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                  "[sticky/queue_handler] peer %i is busy, waiting for %M ms", n, slcf->queue_timeout - waited);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_sticky_queue_resume;
+
+    r->connection->write->delayed = 1;
+    ngx_add_timer( r->connection->write, slcf->queue_timeout - waited );
+
+    return NGX_AGAIN;
+}
+
+/* $sticky_status, after NGX_HTTP_STICKY_OUTCOME_* */
+static ngx_str_t  ngx_http_sticky_outcome_names[] = {
+    ngx_string("miss"),
+    ngx_string("hit"),
+    ngx_string("invalid"),
+    ngx_string("fallback"),
+    ngx_string("busy"),
+};
+
+/* $sticky_lb_alg, after NGX_LB_ALG_*, empty when the route was followed */
+static ngx_str_t  ngx_http_sticky_lb_alg_names[] = {
+    ngx_null_string,
+    ngx_string("rr"),
+    ngx_string("lc"),
+    ngx_string("p2c"),
+    ngx_string("chash"),
+    ngx_string("ewma"),
+    ngx_string("random"),
+    ngx_string("hrw"),
+};
+
+/*
+ * the $sticky_* variables read the decision the request context keeps,
+ * they are not found when no sticky upstream was used
+ */
+static ngx_int_t
+ngx_http_sticky_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_sticky_ctx_t  *ctx = ngx_http_sticky_get_ctx( r, 0 );
+    ngx_str_t              *value;
+
+    if( NULL == ctx || !ctx->decided ) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    switch( data ) {
+
+    case NGX_HTTP_STICKY_VAR_STATUS:
+        value = &ngx_http_sticky_outcome_names[ctx->outcome];
+        break;
+
+    case NGX_HTTP_STICKY_VAR_ROUTE:
+        value = &ctx->route;
+        break;
+
+    case NGX_HTTP_STICKY_VAR_LB_ALG:
+        value = &ngx_http_sticky_lb_alg_names[ctx->lb_alg];
+        break;
+
+    default: /* NGX_HTTP_STICKY_VAR_PEER_INDEX */
+        if( ctx->peer < 0 ) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+
+        v->data = ngx_pnalloc( r->pool, NGX_INT_T_LEN );
+
+        if( NULL == v->data ) {
+            return NGX_ERROR;
+        }
+
+        v->len = ngx_sprintf( v->data, "%i", ctx->peer ) - v->data;
+        v->valid = 1;
+        v->no_cacheable = 0;
+        v->not_found = 0;
 
-    if( (now - best->checked) > best->fail_timeout ) {
-        best->checked = now;
+        return NGX_OK;
     }
 
-    pc->sockaddr = best->sockaddr;
-    pc->socklen  = best->socklen;
-    pc->name     = &best->name;
+    v->len = value->len;
+    v->data = value->data;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
 
-    best->conns ++;
+    return NGX_OK;
+}
 
-    rrp->current = best;
+static ngx_http_variable_t  ngx_http_sticky_vars[] = {
+    { ngx_string("sticky_status"), NULL, ngx_http_sticky_variable,
+      NGX_HTTP_STICKY_VAR_STATUS, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    n = p / (8 * sizeof(uintptr_t));
-    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
-    rrp->tried[n] |= m;
+    { ngx_string("sticky_peer_index"), NULL, ngx_http_sticky_variable,
+      NGX_HTTP_STICKY_VAR_PEER_INDEX, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, pc->log, 0, "[sticky/get_least_conn_peer] set selected_peer as %ui", n);
+    { ngx_string("sticky_route"), NULL, ngx_http_sticky_variable,
+      NGX_HTTP_STICKY_VAR_ROUTE, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    ngx_http_upstream_rr_peers_unlock(peers);
+    { ngx_string("sticky_lb_alg"), NULL, ngx_http_sticky_variable,
+      NGX_HTTP_STICKY_VAR_LB_ALG, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+/*
+ * register the $sticky_* variables
+ */
+static ngx_int_t
+ngx_http_sticky_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for( v = ngx_http_sticky_vars; v->name.len; v++ ) {
+        var = ngx_http_add_variable( cf, &v->name, v->flags );
+
+        if( NULL == var ) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
 
     return NGX_OK;
 }
@@ -658,12 +4222,34 @@ ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     unsigned secure = 0;
     unsigned httponly = 0;
     ngx_uint_t no_fallback = 0;
+    ngx_uint_t stats = 0;
+    ngx_uint_t encoding = NGX_HTTP_STICKY_ENCODING_HEX;
+    ngx_int_t digest_max = 0;
+    ngx_uint_t failover = NGX_HTTP_STICKY_FAILOVER_LB_ALG;
+    time_t failover_reissue = 0;
+    time_t slow_start = 0;
+    ngx_int_t max_load_factor = 0;
 
     ngx_http_sticky_misc_hash_pt hash = NGX_CONF_UNSET_PTR;
     ngx_http_sticky_misc_hmac_pt hmac = NULL;
     ngx_http_sticky_misc_text_pt text = NULL;
 
     ngx_uint_t lb_alg = NGX_LB_ALG_RR;
+    ngx_http_complex_value_t *chash_key = NULL;
+    ngx_http_compile_complex_value_t ccv;
+
+    ngx_http_complex_value_t *route = NULL;
+    ngx_str_t route_suffix = ngx_null_string;
+
+    ngx_uint_t learn = 0;
+    ngx_str_t learn_create = ngx_null_string;
+    ngx_str_t learn_lookup = ngx_null_string;
+    ngx_str_t learn_zone = ngx_null_string;
+    ssize_t learn_size = 0;
+    time_t learn_timeout = NGX_CONF_UNSET;
+    ngx_http_sticky_learn_t *learn_conf = NULL;
+    ngx_shm_zone_t *shm_zone;
+    u_char *p;
 
     /* parse all elements */
     for( i = 1; i < cf->args->nelts; i++ ) {
@@ -692,6 +4278,62 @@ ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                 lb_alg = NGX_LB_ALG_LC;
                 continue;
             }
+
+            /* is lb_alg=p2c */
+            if( 0 == ngx_strncmp(tmp.data, "p2c", sizeof("p2c") - 1) ) {
+                lb_alg = NGX_LB_ALG_P2C;
+                continue;
+            }
+
+            /* is lb_alg=chash */
+            if( 0 == ngx_strncmp(tmp.data, "chash", sizeof("chash") - 1) ) {
+                lb_alg = NGX_LB_ALG_CHASH;
+                continue;
+            }
+
+            /* is lb_alg=random */
+            if( 0 == ngx_strncmp(tmp.data, "random", sizeof("random") - 1) ) {
+                lb_alg = NGX_LB_ALG_RANDOM;
+                continue;
+            }
+
+            /* is lb_alg=ewma */
+            if( 0 == ngx_strncmp(tmp.data, "ewma", sizeof("ewma") - 1) ) {
+                lb_alg = NGX_LB_ALG_EWMA;
+                continue;
+            }
+        }
+
+        /* is "key=" is starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "key=") == value[i].data ) {
+
+            /* do we have at least one char after "key=" ? */
+            if( value[i].len <= (sizeof("key=") - 1 )) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] a value must be provided to \"key=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            /* extract value to temp */
+            tmp.len =  value[i].len - ngx_strlen("key=");
+            tmp.data = (u_char *)(value[i].data + sizeof("key=") - 1);
+
+            /* compile it once, it's evaluated when a peer has to be chosen */
+            chash_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if( NULL == chash_key ) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &tmp;
+            ccv.complex_value = chash_key;
+
+            if( NGX_OK != ngx_http_compile_complex_value(&ccv) ) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
         }
 
         /* is "name=" is starting the argument ? */
@@ -844,6 +4486,12 @@ ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                 continue;
             }
 
+            /* is hash=id */
+            if( 0 == ngx_strncmp(tmp.data, "id", sizeof("id") - 1) ) {
+                hash = ngx_http_sticky_misc_id;
+                continue;
+            }
+
             /* is hash=md5 */
             if( 0 == ngx_strncmp(tmp.data, "md5", sizeof("md5") - 1) ) {
                 hash = ngx_http_sticky_misc_md5;
@@ -857,7 +4505,7 @@ ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             }
 
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "[sticky/sticky_set] wrong value for \"hash=\": index, md5 or sha1");
+                               "[sticky/sticky_set] wrong value for \"hash=\": index, id, md5 or sha1");
             return NGX_CONF_ERROR;
         }
 
@@ -915,6 +4563,230 @@ ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        /* is "route=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "route=") == value[i].data ) {
+
+            if( value[i].len <= (sizeof("route=") - 1 )) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] a value must be provided to \"route=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            tmp.len =  value[i].len - ngx_strlen("route=");
+            tmp.data = (u_char *)(value[i].data + sizeof("route=") - 1);
+
+            /* compile it once, it's evaluated for each request */
+            route = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+            if( NULL == route ) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+            ccv.cf = cf;
+            ccv.value = &tmp;
+            ccv.complex_value = route;
+
+            if( NGX_OK != ngx_http_compile_complex_value(&ccv) ) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "route_suffix=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "route_suffix=") == value[i].data ) {
+
+            if( value[i].len <= (sizeof("route_suffix=") - 1 )) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] a value must be provided to \"route_suffix=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            /* the argument is null terminated, so is the separator */
+            route_suffix.len =  value[i].len - ngx_strlen("route_suffix=");
+            route_suffix.data = (u_char *)(value[i].data + sizeof("route_suffix=") - 1);
+            continue;
+        }
+
+        /* is "learn" flag present ? */
+        if( 0 == ngx_strncmp(value[i].data, "learn", sizeof("learn") - 1) && value[i].len == sizeof("learn") - 1 ) {
+            learn = 1;
+            continue;
+        }
+
+        /* is "create=" or "lookup=" starting the argument ? both are variables */
+        if( (u_char *)ngx_strstr(value[i].data, "create=$") == value[i].data ) {
+            learn_create.len = value[i].len - ngx_strlen("create=$");
+            learn_create.data = (u_char *)(value[i].data + sizeof("create=$") - 1);
+
+            if( 0 == learn_create.len ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] a variable must be provided to \"create=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if( (u_char *)ngx_strstr(value[i].data, "lookup=$") == value[i].data ) {
+            learn_lookup.len = value[i].len - ngx_strlen("lookup=$");
+            learn_lookup.data = (u_char *)(value[i].data + sizeof("lookup=$") - 1);
+
+            if( 0 == learn_lookup.len ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] a variable must be provided to \"lookup=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "zone=" starting the argument ? name:size */
+        if( (u_char *)ngx_strstr(value[i].data, "zone=") == value[i].data ) {
+            learn_zone.data = (u_char *)(value[i].data + sizeof("zone=") - 1);
+
+            p = (u_char *) ngx_strchr(learn_zone.data, ':');
+
+            if( NULL == p ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            learn_zone.len = p - learn_zone.data;
+
+            tmp.data = p + 1;
+            tmp.len = value[i].data + value[i].len - tmp.data;
+
+            learn_size = ngx_parse_size(&tmp);
+
+            if( NGX_ERROR == learn_size || 0 == learn_zone.len ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if( learn_size < (ssize_t) (8 * ngx_pagesize) ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "timeout=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "timeout=") == value[i].data ) {
+            tmp.len =  value[i].len - ngx_strlen("timeout=");
+            tmp.data = (u_char *)(value[i].data + sizeof("timeout=") - 1);
+
+            learn_timeout = ngx_parse_time(&tmp, 1);
+
+            if( NGX_ERROR == learn_timeout || learn_timeout < 1 ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] invalid value for \"timeout=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "encoding=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "encoding=") == value[i].data ) {
+            tmp.len =  value[i].len - ngx_strlen("encoding=");
+            tmp.data = (u_char *)(value[i].data + sizeof("encoding=") - 1);
+
+            if( tmp.len == sizeof("hex") - 1 && 0 == ngx_strncmp(tmp.data, "hex", tmp.len) ) {
+                encoding = NGX_HTTP_STICKY_ENCODING_HEX;
+                continue;
+            }
+
+            if( tmp.len == sizeof("base64url") - 1 && 0 == ngx_strncmp(tmp.data, "base64url", tmp.len) ) {
+                encoding = NGX_HTTP_STICKY_ENCODING_BASE64URL;
+                continue;
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] wrong value for \"encoding=\": hex or base64url");
+            return NGX_CONF_ERROR;
+        }
+
+        /* is "digest_len=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "digest_len=") == value[i].data ) {
+            digest_max = ngx_atoi(value[i].data + sizeof("digest_len=") - 1, value[i].len - ngx_strlen("digest_len="));
+
+            /* under 4 bytes, peers would often share a route */
+            if( NGX_ERROR == digest_max || digest_max < 4 ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "[sticky/sticky_set] invalid value for \"digest_len=\", at least 4 bytes");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "failover=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "failover=") == value[i].data ) {
+            tmp.len =  value[i].len - ngx_strlen("failover=");
+            tmp.data = (u_char *)(value[i].data + sizeof("failover=") - 1);
+
+            if( tmp.len == sizeof("hrw") - 1 && 0 == ngx_strncmp(tmp.data, "hrw", tmp.len) ) {
+                failover = NGX_HTTP_STICKY_FAILOVER_HRW;
+                continue;
+            }
+
+            if( tmp.len == sizeof("lb_alg") - 1 && 0 == ngx_strncmp(tmp.data, "lb_alg", tmp.len) ) {
+                failover = NGX_HTTP_STICKY_FAILOVER_LB_ALG;
+                continue;
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] wrong value for \"failover=\": lb_alg or hrw");
+            return NGX_CONF_ERROR;
+        }
+
+        /* is "failover_reissue=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "failover_reissue=") == value[i].data ) {
+            tmp.len =  value[i].len - ngx_strlen("failover_reissue=");
+            tmp.data = (u_char *)(value[i].data + sizeof("failover_reissue=") - 1);
+
+            failover_reissue = ngx_parse_time(&tmp, 1);
+
+            if( NGX_ERROR == failover_reissue || failover_reissue < 1 ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] invalid value for \"failover_reissue=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "slow_start=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "slow_start=") == value[i].data ) {
+            tmp.len =  value[i].len - ngx_strlen("slow_start=");
+            tmp.data = (u_char *)(value[i].data + sizeof("slow_start=") - 1);
+
+            slow_start = ngx_parse_time(&tmp, 1);
+
+            if( NGX_ERROR == slow_start || slow_start < 1 ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] invalid value for \"slow_start=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "max_load_factor=" starting the argument ? */
+        if( (u_char *)ngx_strstr(value[i].data, "max_load_factor=") == value[i].data ) {
+            max_load_factor = ngx_atofp(value[i].data + sizeof("max_load_factor=") - 1,
+                                        value[i].len - ngx_strlen("max_load_factor="), 2);
+
+            /* at or under the average, every routed peer would spill */
+            if( NGX_ERROR == max_load_factor || max_load_factor <= 100 ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "[sticky/sticky_set] invalid value for \"max_load_factor=\", it must be above 1");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        /* is "stats" flag present ? */
+        if( 0 == ngx_strncmp(value[i].data, "stats", sizeof("stats") - 1) && value[i].len == sizeof("stats") - 1 ) {
+            stats = 1;
+            continue;
+        }
+
         /* is "no_fallback" flag present ? */
         if( 0 == ngx_strncmp(value[i].data, "no_fallback", sizeof("no_fallback") - 1) ) {
             no_fallback = 1;
@@ -944,11 +4816,103 @@ ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    /* the consistent hash needs something to hash */
+    if( NGX_LB_ALG_CHASH == lb_alg && NULL == chash_key ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] please specify \"key=\" when using \"lb_alg=chash\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if( NGX_LB_ALG_CHASH != lb_alg && NULL != chash_key ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] \"key=\" is only meaningful with \"lb_alg=chash\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if( route_suffix.len && NULL == route ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] \"route_suffix=\" is only meaningful with \"route=\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if( route && learn ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] please choose between \"route=\" and \"learn\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* learn mode binds sessions created by the backends, it needs both ends and a zone */
+    if( learn ) {
+        if( 0 == learn_create.len || 0 == learn_lookup.len || 0 == learn_zone.len ) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "[sticky/sticky_set] \"learn\" requires \"create=\", \"lookup=\" and \"zone=\"");
+            return NGX_CONF_ERROR;
+        }
+
+        learn_conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_sticky_learn_t));
+        if( NULL == learn_conf ) {
+            return NGX_CONF_ERROR;
+        }
+
+        learn_conf->timeout = (NGX_CONF_UNSET == learn_timeout) ? NGX_HTTP_STICKY_LEARN_TIMEOUT : learn_timeout;
+
+        learn_conf->create = ngx_http_get_variable_index(cf, &learn_create);
+        if( NGX_ERROR == learn_conf->create ) {
+            return NGX_CONF_ERROR;
+        }
+
+        learn_conf->lookup = ngx_http_get_variable_index(cf, &learn_lookup);
+        if( NGX_ERROR == learn_conf->lookup ) {
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone = ngx_shared_memory_add(cf, &learn_zone, learn_size, &ngx_http_sticky_lc_module);
+        if( NULL == shm_zone ) {
+            return NGX_CONF_ERROR;
+        }
+
+        if( shm_zone->data ) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_set] duplicate zone \"%V\"", &learn_zone);
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone->init = ngx_http_sticky_learn_init_zone;
+        shm_zone->data = learn_conf;
+
+    } else if( learn_create.len || learn_lookup.len || learn_zone.len || NGX_CONF_UNSET != learn_timeout ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[sticky/sticky_set] \"create=\", \"lookup=\", \"zone=\" and \"timeout=\" are only meaningful with \"learn\"");
+        return NGX_CONF_ERROR;
+    }
+
     /* ensure hash is NULL to avoid conflicts later */
     if( NGX_CONF_UNSET_PTR == hash ) {
         hash = NULL;
     }
 
+    /* no_fallback keeps every request on its peer */
+    if( max_load_factor && no_fallback ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[sticky/sticky_set] \"max_load_factor=\" can't be used with \"no_fallback\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if( failover_reissue && NGX_HTTP_STICKY_FAILOVER_HRW != failover ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[sticky/sticky_set] \"failover_reissue=\" is only meaningful with \"failover=hrw\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if( slow_start && NGX_LB_ALG_RR != lb_alg && NGX_LB_ALG_LC != lb_alg ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[sticky/sticky_set] \"slow_start=\" is only meaningful with \"lb_alg=rr\" or \"lb_alg=lc\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* index and text=raw routes are not digests */
+    if( (encoding != NGX_HTTP_STICKY_ENCODING_HEX || digest_max)
+            && ((NULL == hash && NULL == hmac && NULL == text) || ngx_http_sticky_misc_text_raw == text) ) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "[sticky/sticky_set] \"encoding=\" and \"digest_len=\" are meaningless with \"hash=index\" or \"text=raw\"");
+        return NGX_CONF_ERROR;
+    }
+
     /* save the sticky parameters */
     sticky_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_sticky_lc_module);
     sticky_conf->cookie_name = name;
@@ -963,7 +4927,25 @@ ngx_http_sticky_set(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     sticky_conf->hmac_key = hmac_key;
     sticky_conf->no_fallback = no_fallback;
     sticky_conf->lb_alg = lb_alg;
+    sticky_conf->failover = failover;
+    sticky_conf->failover_reissue = failover_reissue;
+    sticky_conf->max_load_factor = max_load_factor;
+    sticky_conf->slow_start = slow_start;
+    sticky_conf->chash_key = chash_key;
+    sticky_conf->learn = learn_conf;
+    sticky_conf->route = route;
+    sticky_conf->route_suffix = route_suffix;
+    sticky_conf->stats_enabled = stats;
+    sticky_conf->stats = NULL;
     sticky_conf->peers = NULL; /* ensure it's null before running */
+    sticky_conf->lookup = NULL;
+    sticky_conf->digest_len = 0;
+    sticky_conf->digest_max = digest_max;
+    sticky_conf->encoding = encoding;
+    sticky_conf->lc_heap = NULL;
+    sticky_conf->chash_points = NULL;
+    sticky_conf->chash_number = 0;
+    sticky_conf->alias = NULL;
 
     upstream_conf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
@@ -1008,3 +4990,149 @@ ngx_http_sticky_create_conf(ngx_conf_t *cf)
 
     return conf;
 }
+
+/*
+ * sticky_status [json|prometheus]
+ */
+static char *
+ngx_http_sticky_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sticky_loc_conf_t  *slcf = conf;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_str_t                   *value = cf->args->elts;
+
+    if( 2 == cf->args->nelts ) {
+
+        if( 0 == ngx_strcmp(value[1].data, "json") ) {
+            slcf->status_format = NGX_HTTP_STICKY_STATUS_JSON;
+
+        } else if( 0 == ngx_strcmp(value[1].data, "prometheus") ) {
+            slcf->status_format = NGX_HTTP_STICKY_STATUS_PROMETHEUS;
+
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "[sticky/sticky_status] invalid format \"%V\": json or prometheus", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_sticky_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+static void *
+ngx_http_sticky_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_sticky_loc_conf_t *conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_sticky_loc_conf_t));
+
+    if( NULL == conf ) {
+        return NULL;
+    }
+
+    return conf;
+}
+
+static char *
+ngx_http_sticky_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_sticky_loc_conf_t *prev = parent;
+    ngx_http_sticky_loc_conf_t *conf = child;
+
+    if( NULL == conf->queue_upstream ) {
+        conf->queue_upstream = prev->queue_upstream;
+        conf->queue_length = prev->queue_length;
+        conf->queue_timeout = prev->queue_timeout;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * sticky_queue <upstream> [length=16] [timeout=50ms]
+ */
+static char *
+ngx_http_sticky_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_sticky_loc_conf_t  *slcf = conf;
+    ngx_str_t                   *value = cf->args->elts;
+    ngx_str_t                    tmp;
+    ngx_url_t                    u;
+    ngx_int_t                    n;
+    ngx_uint_t                   i;
+
+    if( slcf->queue_upstream ) {
+        return "is duplicate";
+    }
+
+    slcf->queue_length = NGX_HTTP_STICKY_QUEUE_LENGTH;
+    slcf->queue_timeout = NGX_HTTP_STICKY_QUEUE_TIMEOUT;
+
+    for( i = 2; i < cf->args->nelts; i++ ) {
+
+        if( (u_char *)ngx_strstr(value[i].data, "length=") == value[i].data ) {
+            n = ngx_atoi(value[i].data + sizeof("length=") - 1, value[i].len - ngx_strlen("length="));
+
+            if( NGX_ERROR == n || n < 1 ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_queue] invalid value for \"length=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            slcf->queue_length = n;
+            continue;
+        }
+
+        if( (u_char *)ngx_strstr(value[i].data, "timeout=") == value[i].data ) {
+            tmp.len = value[i].len - ngx_strlen("timeout=");
+            tmp.data = value[i].data + sizeof("timeout=") - 1;
+
+            slcf->queue_timeout = ngx_parse_time(&tmp, 0);
+
+            if( (ngx_msec_t) NGX_ERROR == slcf->queue_timeout || 0 == slcf->queue_timeout ) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_queue] invalid value for \"timeout=\"");
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[sticky/sticky_queue] invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the upstream may be defined further down, as with proxy_pass */
+    ngx_memzero(&u, sizeof(ngx_url_t));
+    u.url = value[1];
+    u.no_resolve = 1;
+
+    slcf->queue_upstream = ngx_http_upstream_add(cf, &u, 0);
+
+    if( NULL == slcf->queue_upstream ) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * install the sticky_queue handler in the preaccess phase
+ */
+static ngx_int_t
+ngx_http_sticky_init(ngx_conf_t *cf)
+{
+    ngx_http_handler_pt        *h;
+    ngx_http_core_main_conf_t  *cmcf;
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
+
+    if( NULL == h ) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_sticky_queue_handler;
+
+    return NGX_OK;
+}
@@ -34,23 +34,22 @@ static ngx_int_t cookie_expires(char *str, size_t size, time_t t)
     wdays[e.tm_wday], e.tm_mday, months[e.tm_mon], e.tm_year + 1900, e.tm_hour,e.tm_min,e.tm_sec);
 }
 
+/*
+ * worker local cache of the last Expires date formatted,
+ * so it's formatted at most once per second whatever the number of peers
+ */
+static time_t expires_cached_time = 0;
+static char   expires_cached[NGX_HTTP_STICKY_EXPIRES_LEN + 1];
+
 
-ngx_int_t ngx_http_sticky_misc_set_cookie(ngx_http_request_t *r, ngx_str_t *name, ngx_str_t *value, ngx_str_t *domain, ngx_str_t *path, time_t expires, unsigned secure, unsigned httponly)
+/*
+ * build once the whole Set-Cookie value for a route,
+ * only the Expires date is left to patch at request time
+ */
+ngx_int_t ngx_http_sticky_misc_init_cookie(ngx_pool_t *pool, ngx_http_sticky_misc_cookie_t *cookie, ngx_str_t *name, ngx_str_t *value, ngx_str_t *domain, ngx_str_t *path, time_t expires, unsigned secure, unsigned httponly)
 {
-  u_char  *cookie, *p;
+  u_char  *p;
   size_t  len;
-  ngx_table_elt_t *set_cookie, *elt;
-  ngx_str_t remove;
-  ngx_list_part_t *part;
-  ngx_uint_t i;
-  char expires_str[80];
-
-  int expires_len = 0;
-
-  if (value == NULL) {
-    ngx_str_set(&remove, "_remove_");
-    value = &remove;
-  }
 
   /*    name        =   value */
   len = name->len + 1 + value->len;
@@ -61,8 +60,7 @@ ngx_int_t ngx_http_sticky_misc_set_cookie(ngx_http_request_t *r, ngx_str_t *name
   }
   /*; Expires= */
   if (expires != NGX_CONF_UNSET) {
-   expires_len = cookie_expires(expires_str, sizeof(expires_str), time(NULL) + expires);
-   len += sizeof("; Expires=") - 1 + expires_len;
+   len += sizeof("; Expires=") - 1 + NGX_HTTP_STICKY_EXPIRES_LEN;
   }
 
   /* ; Path= */
@@ -80,12 +78,15 @@ ngx_int_t ngx_http_sticky_misc_set_cookie(ngx_http_request_t *r, ngx_str_t *name
     len += sizeof("; HttpOnly") - 1;
   }
 
-  cookie = ngx_pnalloc(r->pool, len);
-  if (cookie == NULL) {
+  cookie->value.data = ngx_pnalloc(pool, len);
+  if (cookie->value.data == NULL) {
     return NGX_ERROR;
   }
 
-  p = ngx_copy(cookie, name->data, name->len);
+  cookie->expires = NULL;
+  cookie->expires_time = 0;
+
+  p = ngx_copy(cookie->value.data, name->data, name->len);
   *p++ = '=';
   p = ngx_copy(p, value->data, value->len);
 
@@ -96,7 +97,8 @@ ngx_int_t ngx_http_sticky_misc_set_cookie(ngx_http_request_t *r, ngx_str_t *name
 
   if (expires != NGX_CONF_UNSET) {
     p = ngx_copy(p, "; Expires=", sizeof("; Expires=") - 1);
-    p = ngx_copy(p, expires_str, expires_len);
+    cookie->expires = p;
+    p += NGX_HTTP_STICKY_EXPIRES_LEN;
   }
 
   if (path->len > 0) {
@@ -112,41 +114,72 @@ ngx_int_t ngx_http_sticky_misc_set_cookie(ngx_http_request_t *r, ngx_str_t *name
     p = ngx_copy(p, "; HttpOnly", sizeof("; HttpOnly") - 1);
   }
 
-  part = &r->headers_out.headers.part;
-  elt = part->elts;
-  set_cookie = NULL;
+  cookie->value.len = p - cookie->value.data;
+
+  return NGX_OK;
+}
 
-  for (i=0 ;; i++) {
-    if (part->nelts > 1 || i >= part->nelts) {
-      if (part->next == NULL) {
-        break;
+
+/*
+ * emit a prebuilt Set-Cookie, nothing is allocated nor formatted here
+ * but once per second for the Expires date.
+ * set_cookie remembers the header emitted for the request, so a retry
+ * overwrites it in place instead of adding a second one.
+ * with copy, the value is copied to the request pool, for templates
+ * which may be freed before the response is sent
+ */
+ngx_int_t ngx_http_sticky_misc_set_cookie(ngx_http_request_t *r, ngx_table_elt_t **set_cookie, ngx_http_sticky_misc_cookie_t *cookie, time_t expires, ngx_uint_t copy)
+{
+  ngx_table_elt_t *elt;
+  ngx_str_t value;
+  time_t t;
+
+  if (cookie->expires) {
+    t = ngx_time() + expires;
+
+    /*
+     * the template is shared by the responses still waiting for their
+     * upstream; they'll just get a date a few seconds later
+     */
+    if (cookie->expires_time != t) {
+
+      if (expires_cached_time != t) {
+        if (cookie_expires(expires_cached, sizeof(expires_cached), t) != NGX_HTTP_STICKY_EXPIRES_LEN) {
+          return NGX_ERROR;
+        }
+        expires_cached_time = t;
       }
-      part = part->next;
-      elt = part->elts;
-      i = 0;
+
+      ngx_memcpy(cookie->expires, expires_cached, NGX_HTTP_STICKY_EXPIRES_LEN);
+      cookie->expires_time = t;
     }
-    /* ... */
-    if (ngx_strncmp(elt->value.data, name->data, name->len) == 0) {
-      set_cookie = elt;
-      break;
+  }
+
+  value = cookie->value;
+
+  if (copy) {
+    value.data = ngx_pnalloc(r->pool, value.len);
+    if (value.data == NULL) {
+      return NGX_ERROR;
     }
+    ngx_memcpy(value.data, cookie->value.data, value.len);
   }
 
-  /* found a Set-Cookie header with the same name: replace it */
-  if (set_cookie != NULL) {
-    set_cookie->value.len = p - cookie;
-    set_cookie->value.data = cookie;
+  /* already emitted for this request: replace it */
+  if (*set_cookie != NULL) {
+    (*set_cookie)->value = value;
     return NGX_OK;
   }
 
-  set_cookie = ngx_list_push(&r->headers_out.headers);
-  if (set_cookie == NULL) {
+  elt = ngx_list_push(&r->headers_out.headers);
+  if (elt == NULL) {
     return NGX_ERROR;
   }
-  set_cookie->hash = 1;
-  ngx_str_set(&set_cookie->key, "Set-Cookie");
-  set_cookie->value.len = p - cookie;
-  set_cookie->value.data = cookie;
+  elt->hash = 1;
+  ngx_str_set(&elt->key, "Set-Cookie");
+  elt->value = value;
+
+  *set_cookie = elt;
 
   return NGX_OK;
 }
@@ -156,17 +189,17 @@ ngx_int_t ngx_http_sticky_misc_md5(ngx_pool_t *pool, void *in, size_t len, ngx_s
   ngx_md5_t md5;
   u_char hash[MD5_DIGEST_LENGTH];
 
-  digest->data = ngx_pcalloc(pool, MD5_DIGEST_LENGTH * 2);
+  digest->data = ngx_pcalloc(pool, MD5_DIGEST_LENGTH);
   if (digest->data == NULL) {
     return NGX_ERROR;
   }
 
-  digest->len = MD5_DIGEST_LENGTH * 2;
+  digest->len = MD5_DIGEST_LENGTH;
   ngx_md5_init(&md5);
   ngx_md5_update(&md5, in, len);
   ngx_md5_final(hash, &md5);
 
-  ngx_hex_dump(digest->data, hash, MD5_DIGEST_LENGTH);
+  ngx_memcpy(digest->data, hash, MD5_DIGEST_LENGTH);
   return NGX_OK;
 }
 
@@ -175,17 +208,49 @@ ngx_int_t ngx_http_sticky_misc_sha1(ngx_pool_t *pool, void *in, size_t len, ngx_
   ngx_sha1_t sha1;
   u_char hash[SHA_DIGEST_LENGTH];
 
-  digest->data = ngx_pcalloc(pool, SHA_DIGEST_LENGTH * 2);
+  digest->data = ngx_pcalloc(pool, SHA_DIGEST_LENGTH);
   if (digest->data == NULL) {
     return NGX_ERROR;
   }
 
-  digest->len = SHA_DIGEST_LENGTH * 2;
+  digest->len = SHA_DIGEST_LENGTH;
   ngx_sha1_init(&sha1);
   ngx_sha1_update(&sha1, in, len);
   ngx_sha1_final(hash, &sha1);
 
-  ngx_hex_dump(digest->data, hash, SHA_DIGEST_LENGTH);
+  ngx_memcpy(digest->data, hash, SHA_DIGEST_LENGTH);
+  return NGX_OK;
+}
+
+/*
+ * a short route which only depends on the server address,
+ * so it doesn't change when servers are added, removed or reordered
+ */
+ngx_int_t ngx_http_sticky_misc_id(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *digest)
+{
+  u_char text[NGX_SOCKADDR_STRLEN];
+  size_t n;
+  uint32_t id;
+
+  digest->data = ngx_pnalloc(pool, sizeof(uint32_t));
+  if (digest->data == NULL) {
+    return NGX_ERROR;
+  }
+
+#if defined(nginx_version) && nginx_version >= 1005003
+  n = ngx_sock_ntop(in, len, text, NGX_SOCKADDR_STRLEN, 1);
+#else
+  n = ngx_sock_ntop(in, text, NGX_SOCKADDR_STRLEN, 1);
+#endif
+  id = ngx_crc32_long(text, n);
+
+  /* most significant byte first, the cookie reads as the id in hex */
+  digest->data[0] = (u_char) (id >> 24);
+  digest->data[1] = (u_char) (id >> 16);
+  digest->data[2] = (u_char) (id >> 8);
+  digest->data[3] = (u_char) id;
+  digest->len = sizeof(uint32_t);
+
   return NGX_OK;
 }
 
@@ -196,11 +261,11 @@ ngx_int_t ngx_http_sticky_misc_hmac_md5(ngx_pool_t *pool, void *in, size_t len,
   ngx_md5_t md5;
   u_int i;
 
-  digest->data = ngx_pcalloc(pool, MD5_DIGEST_LENGTH * 2);
+  digest->data = ngx_pcalloc(pool, MD5_DIGEST_LENGTH);
   if (digest->data == NULL) {
     return NGX_ERROR;
   }
-  digest->len = MD5_DIGEST_LENGTH * 2;
+  digest->len = MD5_DIGEST_LENGTH;
 
   ngx_memzero(k, sizeof(k));
 
@@ -232,7 +297,7 @@ ngx_int_t ngx_http_sticky_misc_hmac_md5(ngx_pool_t *pool, void *in, size_t len,
   ngx_md5_update(&md5, hash, MD5_DIGEST_LENGTH);
   ngx_md5_final(hash, &md5);
 
-  ngx_hex_dump(digest->data, hash, MD5_DIGEST_LENGTH);
+  ngx_memcpy(digest->data, hash, MD5_DIGEST_LENGTH);
 
   return NGX_OK;
 }
@@ -244,11 +309,11 @@ ngx_int_t ngx_http_sticky_misc_hmac_sha1(ngx_pool_t *pool, void *in, size_t len,
   ngx_sha1_t sha1;
   u_int i;
 
-  digest->data = ngx_pcalloc(pool, SHA_DIGEST_LENGTH * 2);
+  digest->data = ngx_pcalloc(pool, SHA_DIGEST_LENGTH);
   if (digest->data == NULL) {
     return NGX_ERROR;
   }
-  digest->len = SHA_DIGEST_LENGTH * 2;
+  digest->len = SHA_DIGEST_LENGTH;
 
   ngx_memzero(k, sizeof(k));
 
@@ -280,7 +345,7 @@ ngx_int_t ngx_http_sticky_misc_hmac_sha1(ngx_pool_t *pool, void *in, size_t len,
   ngx_sha1_update(&sha1, hash, SHA_DIGEST_LENGTH);
   ngx_sha1_final(hash, &sha1);
 
-  ngx_hex_dump(digest->data, hash, SHA_DIGEST_LENGTH);
+  ngx_memcpy(digest->data, hash, SHA_DIGEST_LENGTH);
 
   return NGX_OK;
 }
@@ -360,3 +425,141 @@ ngx_int_t ngx_http_sticky_misc_text_sha1(ngx_pool_t *pool, struct sockaddr *in,
   return ngx_pfree(pool, &str);
 }
 
+
+/*
+ * decode len hex chars from src into len / 2 bytes in dst
+ * returns NGX_ERROR as soon as a char is not an hex digit
+ */
+ngx_int_t ngx_http_sticky_misc_hex_decode(u_char *dst, u_char *src, size_t len)
+{
+  u_char c, hi;
+
+  if (len & 1) {
+    return NGX_ERROR;
+  }
+
+#if (NGX_HAVE_LITTLE_ENDIAN)
+  /*
+   * SWAR path: 8 hex chars are checked and decoded at once in a 64 bit
+   * word. Each byte is range checked against '0'-'9', and against 'a'-'f'
+   * once folded to lower case, then the nibbles are packed into 4 bytes.
+   */
+  {
+    uint64_t x, y, digit, alpha, nib;
+    uint32_t out;
+
+    for ( /* void */ ; len >= 8; len -= 8, src += 8, dst += 4) {
+      ngx_memcpy(&x, src, 8);
+
+      /* no byte may have the high bit set, the range checks rely on it */
+      if (x & 0x8080808080808080ULL) {
+        return NGX_ERROR;
+      }
+
+      y = x | 0x2020202020202020ULL;
+
+      digit = (x + 0x5050505050505050ULL) & ~(x + 0x4646464646464646ULL);
+      alpha = (y + 0x1f1f1f1f1f1f1f1fULL) & ~(y + 0x1919191919191919ULL);
+
+      if (((digit | alpha) & 0x8080808080808080ULL) != 0x8080808080808080ULL) {
+        return NGX_ERROR;
+      }
+
+      nib = (y & 0x0f0f0f0f0f0f0f0fULL) + ((alpha >> 7) & 0x0101010101010101ULL) * 9;
+
+      nib = ((nib << 4) | (nib >> 8)) & 0x00ff00ff00ff00ffULL;
+      nib = (nib | (nib >> 8)) & 0x0000ffff0000ffffULL;
+      out = (uint32_t) (nib | (nib >> 16));
+
+      ngx_memcpy(dst, &out, 4);
+    }
+  }
+#endif
+
+  /* scalar path: what's left, or everything on big endian hosts */
+  for ( /* void */ ; len > 0; len -= 2) {
+    hi = 0;
+
+    for (c = 0; c < 2; c++) {
+      u_char ch = *src++;
+
+      if (ch >= '0' && ch <= '9') {
+        hi = (u_char) ((hi << 4) | (ch - '0'));
+      } else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+        hi = (u_char) ((hi << 4) | ((ch | 0x20) - 'a' + 10));
+      } else {
+        return NGX_ERROR;
+      }
+    }
+
+    *dst++ = hi;
+  }
+
+  return NGX_OK;
+}
+
+
+/*
+ * find the cookie name in the Cookie headers, value points into the header
+ * buffer, nothing is copied. Each header is walked once, memchr() (which
+ * libc vectorizes) jumps from one ';' to the next and only the cookies of
+ * the right length are compared, case insensitively like nginx does.
+ *
+ * When the cookie comes several times (different paths or domains), the
+ * first one for which match() returns NGX_OK is used, or the first one if
+ * none does. match() is only called once a duplicate shows up.
+ */
+ngx_int_t ngx_http_sticky_misc_find_cookie(ngx_array_t *headers, ngx_str_t *name, ngx_str_t *value,
+                                           ngx_http_sticky_misc_match_pt match, void *data)
+{
+  u_char           *p, *end, *semi;
+  ngx_str_t         found;
+  ngx_uint_t        i, n;
+  ngx_table_elt_t **h;
+
+  n = 0;
+  h = headers->elts;
+
+  for (i = 0; i < headers->nelts; i++) {
+    p = h[i]->value.data;
+    end = p + h[i]->value.len;
+
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+      }
+
+      semi = memchr(p, ';', end - p);
+
+      if (semi == NULL) {
+        semi = end;
+      }
+
+      if ((size_t) (semi - p) > name->len && p[name->len] == '='
+          && ngx_strncasecmp(p, name->data, name->len) == 0)
+      {
+        found.data = p + name->len + 1;
+        found.len = semi - found.data;
+
+        if (n++ == 0) {
+          *value = found;
+
+        } else {
+          /* a duplicate, check the first one only now */
+          if (n == 2 && (match == NULL || match(data, value) == NGX_OK)) {
+            return NGX_OK;
+          }
+
+          if (match && match(data, &found) == NGX_OK) {
+            *value = found;
+            return NGX_OK;
+          }
+        }
+      }
+
+      p = semi + 1;
+    }
+  }
+
+  return n ? NGX_OK : NGX_DECLINED;
+}
@@ -11,13 +11,26 @@
 #include <ngx_http.h>
 #include <ngx_string.h>
 
+/* length of an Expires date: "Thu, 01-Jan-1970 00:00:00 GMT" */
+#define NGX_HTTP_STICKY_EXPIRES_LEN 29
+
+/* a Set-Cookie value built once, only the Expires date changes */
+typedef struct {
+  ngx_str_t  value;
+  u_char    *expires;      /* Expires date inside value, NULL for session cookies */
+  time_t     expires_time; /* time the date currently written stands for */
+} ngx_http_sticky_misc_cookie_t;
+
 typedef ngx_int_t (*ngx_http_sticky_misc_hash_pt)(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *digest);
 typedef ngx_int_t (*ngx_http_sticky_misc_hmac_pt)(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *key, ngx_str_t *digest);
 typedef ngx_int_t (*ngx_http_sticky_misc_text_pt)(ngx_pool_t *pool, struct sockaddr *in, ngx_str_t *digest);
+typedef ngx_int_t (*ngx_http_sticky_misc_match_pt)(void *data, ngx_str_t *value);
 
-ngx_int_t ngx_http_sticky_misc_set_cookie (ngx_http_request_t *r, ngx_str_t *name, ngx_str_t *value, ngx_str_t *domain, ngx_str_t *path, time_t expires, unsigned secure, unsigned httponly);
+ngx_int_t ngx_http_sticky_misc_init_cookie(ngx_pool_t *pool, ngx_http_sticky_misc_cookie_t *cookie, ngx_str_t *name, ngx_str_t *value, ngx_str_t *domain, ngx_str_t *path, time_t expires, unsigned secure, unsigned httponly);
+ngx_int_t ngx_http_sticky_misc_set_cookie(ngx_http_request_t *r, ngx_table_elt_t **set_cookie, ngx_http_sticky_misc_cookie_t *cookie, time_t expires, ngx_uint_t copy);
 ngx_int_t ngx_http_sticky_misc_md5(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *digest);
 ngx_int_t ngx_http_sticky_misc_sha1(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *digest);
+ngx_int_t ngx_http_sticky_misc_id(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *digest);
 ngx_int_t ngx_http_sticky_misc_hmac_md5(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *key, ngx_str_t *digest);
 ngx_int_t ngx_http_sticky_misc_hmac_sha1(ngx_pool_t *pool, void *in, size_t len, ngx_str_t *key, ngx_str_t *digest);
 
@@ -25,4 +38,7 @@ ngx_int_t ngx_http_sticky_misc_text_raw(ngx_pool_t *pool, struct sockaddr *in, n
 ngx_int_t ngx_http_sticky_misc_text_md5(ngx_pool_t *pool, struct sockaddr *in, ngx_str_t *digest);
 ngx_int_t ngx_http_sticky_misc_text_sha1(ngx_pool_t *pool, struct sockaddr *in, ngx_str_t *digest);
 
+ngx_int_t ngx_http_sticky_misc_hex_decode(u_char *dst, u_char *src, size_t len);
+ngx_int_t ngx_http_sticky_misc_find_cookie(ngx_array_t *headers, ngx_str_t *name, ngx_str_t *value, ngx_http_sticky_misc_match_pt match, void *data);
+
 #endif /* _NGX_HTTP_STICKY_MISC_H_INCLUDED_ */